@@ -0,0 +1,157 @@
+/*
+ * Micro-benchmark for blit_rgb in src/blit.cpp, the copy behind every push.
+ * Pushes fragments of the sizes found in examples/push-data, in each buffer
+ * type, to a 720x400 canvas and compares the time against converting row by
+ * row with the active kernels, which is what pushes did before. Both have to
+ * produce the same canvas.
+ *
+ *   g++ -O2 -Isrc bench/blit_bench.cpp src/blit.cpp src/pixel_convert.cpp -o blit_bench
+ *   ./blit_bench [push-data directory]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <dirent.h>
+
+#include "blit.h"
+
+#define CANVAS_W 720
+#define CANVAS_H 400
+#define ROUNDS 10
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+struct fragment {
+    int x, y, w, h;
+};
+
+static const struct {
+    const char *name;
+    buffer_type type;
+    int bpp;
+    row_converter pixel_kernels::*fn;
+} formats[] = {
+    { "rgb", BUF_RGB, 3, NULL },
+    { "bgr", BUF_BGR, 3, &pixel_kernels::bgr_to_rgb },
+    { "rgba", BUF_RGBA, 4, &pixel_kernels::rgba_to_rgb },
+    { "bgra", BUF_BGRA, 4, &pixel_kernels::bgra_to_rgb }
+};
+
+// the row by row copy pushes used to do
+static void
+push_rows(unsigned char *canvas, const unsigned char *src, const fragment &f,
+    int bpp, row_converter convert)
+{
+    for (int i = 0; i < f.h; i++) {
+        unsigned char *dst = canvas + ((f.y + i)*CANVAS_W + f.x)*3;
+        if (convert)
+            convert(src, dst, f.w);
+        else
+            memcpy(dst, src, f.w*3);
+        src += f.w*bpp;
+    }
+}
+
+static void
+push_blit(unsigned char *canvas, const unsigned char *src, const fragment &f,
+    int bpp, buffer_type type)
+{
+    blit_rgb(canvas + (f.y*CANVAS_W + f.x)*3, CANVAS_W*3, src, f.w*bpp,
+        f.w, f.h, type);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *dir_name = argc > 1 ? argv[1] : "examples/push-data";
+    std::vector<fragment> fragments;
+
+    DIR *dir = opendir(dir_name);
+    if (dir) {
+        struct dirent *e;
+        while ((e = readdir(dir))) {
+            fragment f;
+            if (sscanf(e->d_name, "%*d-%*[a-z]-%d-%d-%d-%d.dat", &f.x, &f.y, &f.w, &f.h) == 4)
+                fragments.push_back(f);
+        }
+        closedir(dir);
+    }
+    // a full width update, to show the case rows are merged in
+    fragment full = { 0, 100, CANVAS_W, 200 };
+    fragments.push_back(full);
+    if (fragments.size() == 1)
+        printf("no fragments in %s, only timing a full width one\n", dir_name);
+
+    pixel_convert_init();
+    const pixel_kernels *kernels = pixel_kernels_active();
+    printf("%d fragments, %s kernels\n", (int)fragments.size(), kernels->name);
+
+    unsigned char *src = (unsigned char *)malloc(CANVAS_W*CANVAS_H*4);
+    unsigned char *want = (unsigned char *)malloc(CANVAS_W*CANVAS_H*3);
+    unsigned char *got = (unsigned char *)malloc(CANVAS_W*CANVAS_H*3);
+    for (int i = 0; i < CANVAS_W*CANVAS_H*4; i++)
+        src[i] = rand();
+
+    for (int k = 0; k < 4; k++) {
+        int bpp = formats[k].bpp;
+        row_converter convert = formats[k].fn ? kernels->*formats[k].fn : NULL;
+
+        for (size_t j = 0; j < fragments.size(); j++) {
+            const fragment &f = fragments[j];
+            memset(want, 0, CANVAS_W*CANVAS_H*3);
+            memset(got, 0, CANVAS_W*CANVAS_H*3);
+            push_rows(want, src, f, bpp, convert);
+            push_blit(got, src, f, bpp, formats[k].type);
+            if (memcmp(want, got, CANVAS_W*CANVAS_H*3) != 0) {
+                printf("%s %dx%d: mismatch\n", formats[k].name, f.w, f.h);
+                return 1;
+            }
+        }
+
+        // the push-data fragments together, then the full width one. The
+        // two methods take turns in short rounds and the best round of each
+        // counts, so frequency changes and other load hit both alike.
+        for (int full_width = 0; full_width < 2; full_width++) {
+            size_t first = full_width ? fragments.size() - 1 : 0;
+            size_t last = full_width ? fragments.size() : fragments.size() - 1;
+            double pixels = 0, t_rows = 1e9, t_blit = 1e9;
+            for (int round = 0; round < 2*ROUNDS; round++) {
+                int method = round & 1;
+                int passes = 0;
+                double start = now(), elapsed;
+                do {
+                    for (size_t j = first; j < last; j++) {
+                        if (method == 0)
+                            push_rows(got, src, fragments[j], bpp, convert);
+                        else
+                            push_blit(got, src, fragments[j], bpp, formats[k].type);
+                    }
+                    passes++;
+                    elapsed = now() - start;
+                } while (elapsed < 0.05);
+                double &best = method == 0 ? t_rows : t_blit;
+                if (elapsed/passes < best)
+                    best = elapsed/passes;
+            }
+            for (size_t j = first; j < last; j++)
+                pixels += (double)fragments[j].w*fragments[j].h;
+            printf("%-4s %-10s rows %8.1f Mpix/s  blit %8.1f Mpix/s\n",
+                formats[k].name, full_width ? "full width" : "push-data",
+                pixels/t_rows/1e6, pixels/t_blit/1e6);
+        }
+    }
+
+    free(src);
+    free(want);
+    free(got);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Micro-benchmark for the pixel format converters in src/pixel_convert.cpp.
+ * Checks every kernel set the CPU supports against the scalar one and then
+ * reports its throughput in GB/s of source pixels. The resamplers are only
+ * checked, their speed shows in encodes with targetWidth/targetHeight. The
+ * content hash must come out the same with every kernel set.
+ *
+ *   g++ -O2 -Isrc bench/pixel_convert_bench.cpp src/pixel_convert.cpp -o convert_bench
+ *   ./convert_bench [row width in pixels]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "pixel_convert.h"
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+struct swizzle {
+    const char *name;
+    int bpp;
+    row_converter pixel_kernels::*fn;
+};
+
+static const swizzle swizzles[] = {
+    { "rgba->rgb", 4, &pixel_kernels::rgba_to_rgb },
+    { "bgra->rgb", 4, &pixel_kernels::bgra_to_rgb },
+    { "bgr->rgb", 3, &pixel_kernels::bgr_to_rgb }
+};
+
+static bool
+verify(const pixel_kernels *scalar, const pixel_kernels *k, const swizzle &s)
+{
+    unsigned char src[4*300], want[3*300 + 64], got[3*300 + 64];
+    for (int i = 0; i < (int)sizeof(src); i++)
+        src[i] = rand();
+
+    for (int n = 0; n < 300; n++) {
+        memset(want, 0xAA, sizeof(want));
+        memset(got, 0xAA, sizeof(got));
+        (scalar->*s.fn)(src, want, n);
+        (k->*s.fn)(src, got, n);
+        if (memcmp(want, got, sizeof(want)) != 0) {
+            printf("%s %s: mismatch at %d pixels\n", k->name, s.name, n);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+verify_resample(const pixel_kernels *scalar, const pixel_kernels *k)
+{
+    unsigned char src[8][4*300 + 4], want[4*300], got[4*300];
+    const unsigned char *rows[8];
+    short weights[8*300];
+    int bounds[2*300];
+    for (int r = 0; r < 8; r++) {
+        for (int i = 0; i < (int)sizeof(src[r]); i++)
+            src[r][i] = rand();
+        rows[r] = src[r];
+    }
+
+    for (int count = 1; count <= 8; count++) {
+        // weights of a box filter over `count` rows or pixels
+        for (int i = 0; i < 8*300; i++)
+            weights[i] = (1 << RESAMPLE_BITS)/count +
+                (i%8 == 0 ? (1 << RESAMPLE_BITS)%count : 0);
+        for (int x = 0; x < 300; x++) {
+            bounds[2*x] = x*(300 - count)/300;
+            bounds[2*x + 1] = count;
+        }
+
+        for (int n = 0; n < 300; n++) {
+            scalar->resample_vertical(rows, weights, count, want, 4*n);
+            k->resample_vertical(rows, weights, count, got, 4*n);
+            if (memcmp(want, got, 4*n) != 0) {
+                printf("%s vertical: mismatch at %d rows\n", k->name, count);
+                return false;
+            }
+        }
+        for (int bpp = 3; bpp <= 4; bpp++) {
+            horizontal_resampler s = bpp == 3 ? scalar->resample_horizontal3 : scalar->resample_horizontal4;
+            horizontal_resampler h = bpp == 3 ? k->resample_horizontal3 : k->resample_horizontal4;
+            s(src[0], want, 300, bounds, weights, 8);
+            h(src[0], got, 300, bounds, weights, 8);
+            if (memcmp(want, got, 300*bpp) != 0) {
+                printf("%s horizontal %d: mismatch at %d taps\n", k->name, bpp, count);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static volatile uint64_t hash_sink; // keeps the hash from being optimized out
+
+static bool
+verify_hash(const pixel_kernels *scalar, const pixel_kernels *k)
+{
+    unsigned char src[4*HASH_BLOCK + 64];
+    for (int i = 0; i < (int)sizeof(src); i++)
+        src[i] = rand();
+
+    for (int len = 0; len <= (int)sizeof(src); len++) {
+        if (pixel_hash_with(scalar, src, len) != pixel_hash_with(k, src, len)) {
+            printf("%s hash: mismatch at %d bytes\n", k->name, len);
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    int width = argc > 1 ? atoi(argv[1]) : 1920;
+    int rows = (64 << 20) / (width*4) + 1;
+
+    unsigned char *src = (unsigned char *)malloc((size_t)width*rows*4);
+    unsigned char *dst = (unsigned char *)malloc((size_t)width*3);
+    for (size_t i = 0; i < (size_t)width*rows*4; i++)
+        src[i] = i*31;
+
+    const pixel_kernels *kernels[4];
+    int n = pixel_kernels_available(kernels, 4);
+
+    printf("row width %d pixels\n", width);
+    for (int k = 0; k < n; k++) {
+        if (!verify_resample(kernels[0], kernels[k]) ||
+            !verify_hash(kernels[0], kernels[k]))
+        {
+            return 1;
+        }
+        for (int s = 0; s < 3; s++) {
+            const swizzle &sw = swizzles[s];
+            if (!verify(kernels[0], kernels[k], sw))
+                return 1;
+
+            row_converter fn = kernels[k]->*sw.fn;
+            int passes = 0;
+            double start = now(), elapsed;
+            do {
+                for (int r = 0; r < rows; r++)
+                    fn(src + (size_t)r*width*sw.bpp, dst, width);
+                passes++;
+                elapsed = now() - start;
+            } while (elapsed < 0.5);
+
+            double bytes = (double)passes*rows*width*sw.bpp;
+            printf("%-8s %-10s %6.2f GB/s\n", kernels[k]->name, sw.name, bytes/elapsed/1e9);
+        }
+
+        size_t len = (size_t)width*rows*4;
+        int passes = 0;
+        double start = now(), elapsed;
+        do {
+            hash_sink = pixel_hash_with(kernels[k], src, len);
+            passes++;
+            elapsed = now() - start;
+        } while (elapsed < 0.5);
+        printf("%-8s %-10s %6.2f GB/s\n", kernels[k]->name, "hash",
+            (double)passes*len/elapsed/1e9);
+    }
+
+    free(src);
+    free(dst);
+    return 0;
+}
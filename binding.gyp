@@ -4,10 +4,26 @@
             "target_name": "jpeg",
             "sources": [
                 "src/common.cpp",
+                "src/pixel_convert.cpp",
+                "src/blit.cpp",
+                "src/async_push.cpp",
+                "src/resizer.cpp",
+                "src/buffer_pool.cpp",
+                "src/compressor_cache.cpp",
+                "src/encoder_pool.cpp",
+                "src/encode_cache.cpp",
+                "src/mcu_row_cache.cpp",
                 "src/jpeg_encoder.cpp",
+                "src/frame_buffer.cpp",
+                "src/tiled_canvas.cpp",
+                "src/jpeg_decompressor.cpp",
+                "src/jpeg_cropper.cpp",
                 "src/jpeg.cpp",
+                "src/jpeg_decoder.cpp",
                 "src/fixed_jpeg_stack.cpp",
                 "src/dynamic_jpeg_stack.cpp",
+                "src/frame_source.cpp",
+                "src/mjpeg_stream.cpp",
                 "src/module.cpp",
             ],
             "include_dirs" : [
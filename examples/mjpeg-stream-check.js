@@ -0,0 +1,46 @@
+// Checks that MjpegStream skips ticks while the stack is idle, and that
+// changing the quality alone, with no pushes, brings a new part.
+
+var fs  = require('fs');
+var jpeg_module = require('../');
+var FixedJpegStack = jpeg_module.FixedJpegStack;
+var MjpegStream = jpeg_module.MjpegStream;
+
+var rgba = fs.readFileSync(__dirname + '/rgba-terminal.dat');
+
+var stack = new FixedJpegStack(720, 400, 'rgba');
+stack.setQuality(90);
+stack.push(rgba, 0, 0, 720, 400);
+
+var stream = new MjpegStream(stack, { fps: 50, boundary: 'frame' });
+var parts = [];
+
+function fail(msg) {
+    stream.stop();
+    throw new Error('mjpeg stream: ' + msg);
+}
+
+stream.start(function (part, err) {
+    if (err) fail(err);
+    parts.push(part);
+});
+
+// the first part, then idle ticks for a while
+setTimeout(function () {
+    if (parts.length != 1)
+        fail('expected 1 part before any change, got ' + parts.length);
+    if (stream.stats().skippedIdle == 0)
+        fail('idle ticks were not skipped');
+
+    stack.setQuality(20);
+
+    setTimeout(function () {
+        stream.stop();
+        if (parts.length != 2)
+            fail('expected a new part after setQuality, got ' + (parts.length - 1));
+        if (parts[1].length >= parts[0].length)
+            fail('the part after setQuality(20) is not smaller');
+        console.log('mjpeg stream: ' + parts[0].length + ' byte part at quality 90, ' +
+            parts[1].length + ' after setQuality(20) with no pushes');
+    }, 300);
+}, 300);
@@ -0,0 +1,65 @@
+// Encodes the same image serially and in parallel stripes and checks that
+// both decode to the same pixels. Restart markers only reset the entropy
+// coder's state, so the coefficients, and the decoded image, must not change.
+
+var fs  = require('fs');
+var jpeg_module = require('../');
+var Jpeg = jpeg_module.Jpeg;
+var JpegDecoder = jpeg_module.JpegDecoder;
+
+var rgba = fs.readFileSync(__dirname + '/rgba-terminal.dat');
+
+// tile the 720x400 terminal 3x3, big enough to be cut into stripes
+var width = 720*3, height = 400*3;
+var big = new Buffer(width*height*4);
+for (var y = 0; y < height; y++) {
+    for (var tx = 0; tx < 3; tx++) {
+        rgba.copy(big, (y*width + tx*720)*4,
+            (y%400)*720*4, (y%400 + 1)*720*4);
+    }
+}
+
+jpeg_module.configureThreadPool({ threads: 4 });
+
+function has_restart_markers(jpeg) {
+    for (var i = 0; i < jpeg.length - 1; i++) {
+        if (jpeg[i] == 0xFF && jpeg[i+1] >= 0xD0 && jpeg[i+1] <= 0xD7)
+            return true;
+    }
+    return false;
+}
+
+function encode(parallel, options) {
+    var jpeg = new Jpeg(big, width, height, 'rgba');
+    jpeg.setQuality(80);
+    jpeg.setOptions(options);
+    jpeg.setParallel(parallel);
+    return jpeg.encodeSync();
+}
+
+var option_sets = [
+    { subsampling: '420' },
+    { subsampling: '444' },
+    { subsampling: '422', dct: 'fast' },
+    { subsampling: 'gray' }
+];
+
+option_sets.forEach(function (options) {
+    var serial = encode(false, options);
+    var striped = encode(true, options);
+    var name = JSON.stringify(options);
+
+    if (!has_restart_markers(striped))
+        throw new Error(name + ': the parallel encode was not striped');
+
+    var a = new JpegDecoder(serial).decodeSync();
+    var b = new JpegDecoder(striped).decodeSync();
+    if (a.length != b.length)
+        throw new Error(name + ': decoded sizes differ');
+    for (var i = 0; i < a.length; i++) {
+        if (a[i] != b[i])
+            throw new Error(name + ': decoded pixels differ at byte ' + i);
+    }
+    console.log(name + ': ' + serial.length + ' bytes serial, ' +
+        striped.length + ' striped, same pixels');
+});
@@ -6,3 +6,5 @@ require('./jpeg-example-async')
 require('./jpeg-example')
 require('./jpeg-example2-async')
 require('./jpeg-example2')
+require('./parallel-encode-check')
+require('./mjpeg-stream-check')
@@ -0,0 +1,146 @@
+#include "async_push.h"
+#include "encoder_pool.h"
+
+// Blits smaller than this many pixels aren't worth splitting over threads.
+#define PARALLEL_BLIT_PIXELS (1 << 18)
+// pixels of one band of rows when they are split
+#define BLIT_BAND_PIXELS (1 << 16)
+
+PushFence::PushFence() : issued(0), done(0), running(false)
+{
+    uv_mutex_init(&lock);
+    uv_cond_init(&finished);
+}
+
+PushFence::~PushFence()
+{
+    uv_cond_destroy(&finished);
+    uv_mutex_destroy(&lock);
+}
+
+void
+PushFence::issue(push_request *push_req)
+{
+    push_req->ticket = ++issued;
+    uv_mutex_lock(&lock);
+    queued.push_back(push_req);
+    uv_mutex_unlock(&lock);
+}
+
+// Ticket of the last push, 0 if there was none.
+unsigned long
+PushFence::last() const
+{
+    return issued;
+}
+
+bool
+PushFence::pending()
+{
+    uv_mutex_lock(&lock);
+    bool ret = done != issued;
+    uv_mutex_unlock(&lock);
+    return ret;
+}
+
+// Finishes every push made so far.
+void
+PushFence::settle()
+{
+    run_until(issued);
+}
+
+static void blit_push(push_request *push_req);
+
+// Runs the queued pushes up to `ticket` on this thread, one at a time. Only
+// waits when another thread is in the middle of one.
+void
+PushFence::run_until(unsigned long ticket)
+{
+    uv_mutex_lock(&lock);
+    while (done < ticket) {
+        if (running || queued.empty()) {
+            uv_cond_wait(&finished, &lock);
+            continue;
+        }
+        push_request *next = queued.front();
+        queued.pop_front();
+        running = true;
+        uv_mutex_unlock(&lock);
+
+        blit_push(next);
+
+        uv_mutex_lock(&lock);
+        running = false;
+        done = next->ticket; // next may be freed from here on
+        uv_cond_broadcast(&finished);
+    }
+    uv_mutex_unlock(&lock);
+}
+
+struct blit_job {
+    const std::vector<blit_op> *bands;
+    buffer_type buf_type;
+};
+
+static void
+blit_band(void *arg, int i)
+{
+    blit_job *job = (blit_job *)arg;
+    const blit_op &op = (*job->bands)[i];
+    blit_rgb(op.dst, op.dst_stride, op.src, op.src_stride, op.w, op.h,
+        job->buf_type);
+}
+
+static void
+blit_push(push_request *push_req)
+{
+    const std::vector<blit_op> &ops = push_req->ops;
+    size_t pixels = 0;
+    for (size_t i = 0; i < ops.size(); i++)
+        pixels += (size_t)ops[i].w*ops[i].h;
+
+    if (pixels < PARALLEL_BLIT_PIXELS || EncoderPool::size() < 2) {
+        for (size_t i = 0; i < ops.size(); i++) {
+            const blit_op &op = ops[i];
+            blit_rgb(op.dst, op.dst_stride, op.src, op.src_stride, op.w, op.h,
+                push_req->buf_type);
+        }
+    }
+    else {
+        // bands of whole rows, small ops like tiles stay in one piece
+        std::vector<blit_op> bands;
+        for (size_t i = 0; i < ops.size(); i++) {
+            blit_op band = ops[i];
+            int band_rows = band.w > 0 ? BLIT_BAND_PIXELS/band.w : band.h;
+            if (band_rows < 1) band_rows = 1;
+            for (int y = 0; y < ops[i].h; y += band_rows) {
+                band.h = ops[i].h - y < band_rows ? ops[i].h - y : band_rows;
+                bands.push_back(band);
+                band.dst += band.h*band.dst_stride;
+                band.src += band.h*band.src_stride;
+            }
+        }
+        blit_job job = { &bands, push_req->buf_type };
+        EncoderPool::parallel_for((int)bands.size(), blit_band, &job);
+    }
+}
+
+void
+run_push(push_request *push_req)
+{
+    push_req->fence->run_until(push_req->ticket);
+}
+
+void
+finish_push(push_request *push_req)
+{
+    NanScope();
+
+    if (push_req->callback) {
+        push_req->callback->Call(0, NULL);
+        delete push_req->callback;
+    }
+    NanDisposePersistent(push_req->buffer);
+    delete push_req;
+}
@@ -0,0 +1,61 @@
+#ifndef ASYNC_PUSH_H
+#define ASYNC_PUSH_H
+
+#include <deque>
+#include <vector>
+#include "common.h"
+#include "blit.h"
+
+struct push_request;
+
+/*
+ * Keeps the pushAsync calls of a stack in order with each other and with
+ * everything else done to the stack. Every async push takes a ticket on the
+ * main thread and joins the stack's own queue. Whoever needs the pushes up
+ * to some ticket done runs the queued ones itself, in order: the push's pool
+ * job, an async encode for the pushes made before it was requested, or the
+ * main thread in settle() before touching pixels that a pending push may
+ * still write or that it would copy. So nobody waits for the pool to reach
+ * a push behind other stacks' work, only for a blit already running.
+ */
+class PushFence {
+    uv_mutex_t lock;
+    uv_cond_t finished;
+    unsigned long issued; // main thread only
+    unsigned long done;
+    bool running; // the push after `done` is being blitted
+    std::deque<push_request *> queued; // not started yet, in ticket order
+
+public:
+    PushFence();
+    ~PushFence();
+
+    void issue(push_request *push_req);
+    unsigned long last() const;
+    bool pending();
+    void settle();
+
+    // any thread
+    void run_until(unsigned long ticket);
+};
+
+// A pushAsync between the main thread and the pool.
+struct push_request {
+    NanCallback *callback; // NULL if none was given
+    void *stack;
+    Persistent<v8::Object> buffer; // keeps the pushed pixels alive
+    PushFence *fence;
+    unsigned long ticket; // set by PushFence::issue
+    std::vector<blit_op> ops; // prepared on the main thread
+    buffer_type buf_type;
+};
+
+// Makes sure the push and the ones before it are done. The blits of each
+// push are split by rows over the EncoderPool when they're large.
+void run_push(push_request *push_req);
+
+// Calls the request's callback and frees it. The caller still has to Unref
+// the stack.
+void finish_push(push_request *push_req);
+
+#endif
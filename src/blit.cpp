@@ -0,0 +1,64 @@
+#include <cstring>
+
+#include "blit.h"
+
+// Fragments narrower than this many pixels go through the rect kernels, one
+// call for the whole fragment. Wider rows are long enough for the row
+// kernels' wide vector steps to pay for a call per row.
+#define NARROW_BLIT_PIXELS 40
+
+// Bytes per pixel of each buffer_type, known at compile time.
+template <buffer_type SRC> struct pixel_layout { enum { bpp = 3 }; };
+template <> struct pixel_layout<BUF_RGBA> { enum { bpp = 4 }; };
+template <> struct pixel_layout<BUF_BGRA> { enum { bpp = 4 }; };
+
+template <buffer_type SRC>
+static void
+blit(unsigned char *dst, size_t dst_stride, const unsigned char *src,
+    size_t src_stride, int w, int h, row_converter row, rect_converter rect)
+{
+    typedef pixel_layout<SRC> L;
+
+    // rows that follow each other on both sides, as with full-width
+    // pushes, are one long row
+    if (h > 1 && src_stride == (size_t)w*L::bpp && dst_stride == (size_t)w*3) {
+        w *= h;
+        h = 1;
+    }
+
+    if (SRC != BUF_RGB && h > 1 && w < NARROW_BLIT_PIXELS) {
+        rect(src, src_stride, dst, dst_stride, w, h);
+        return;
+    }
+
+    for (int y = 0; y < h; y++, src += src_stride, dst += dst_stride) {
+        if (SRC == BUF_RGB)
+            memcpy(dst, src, (size_t)w*3);
+        else
+            row(src, dst, w);
+    }
+}
+
+void
+blit_rgb(unsigned char *dst, size_t dst_stride, const unsigned char *src,
+    size_t src_stride, int w, int h, buffer_type buf_type)
+{
+    const pixel_kernels *k = pixel_kernels_active();
+    switch (buf_type) {
+    case BUF_RGB:
+        blit<BUF_RGB>(dst, dst_stride, src, src_stride, w, h, NULL, NULL);
+        break;
+    case BUF_BGR:
+        blit<BUF_BGR>(dst, dst_stride, src, src_stride, w, h,
+            k->bgr_to_rgb, k->bgr_to_rgb_rect);
+        break;
+    case BUF_RGBA:
+        blit<BUF_RGBA>(dst, dst_stride, src, src_stride, w, h,
+            k->rgba_to_rgb, k->rgba_to_rgb_rect);
+        break;
+    case BUF_BGRA:
+        blit<BUF_BGRA>(dst, dst_stride, src, src_stride, w, h,
+            k->bgra_to_rgb, k->bgra_to_rgb_rect);
+        break;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <cstddef>
+#include "pixel_convert.h"
+
+// Copies a w x h image in `buf_type`, with rows `src_stride` bytes apart, to
+// the RGB canvas at `dst`, with rows `dst_stride` bytes apart.
+void blit_rgb(unsigned char *dst, size_t dst_stride, const unsigned char *src,
+    size_t src_stride, int w, int h, buffer_type buf_type);
+
+// One blit_rgb call, for blits set up on one thread and run on another.
+struct blit_op {
+    unsigned char *dst;
+    size_t dst_stride;
+    const unsigned char *src;
+    size_t src_stride;
+    int w, h;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include <cstdlib>
+#include <uv.h>
+
+#include "buffer_pool.h"
+
+/*
+ * Buffers are grouped into size classes of 4 steps per power of two, from
+ * 4KB to 64MB, so a buffer is never more than 25% larger than asked for.
+ * Bigger buffers are malloc'd and freed directly.
+ */
+
+#define MIN_SHIFT 12
+#define MAX_SHIFT 26
+#define NUM_CLASSES ((MAX_SHIFT - MIN_SHIFT)*4 + 1)
+
+// idle memory kept around across all classes
+#define POOL_MAX_BYTES (32 << 20)
+
+union buffer_header {
+    struct {
+        size_t capacity;
+        union buffer_header *next;
+    } h;
+    double align[2]; // keep the payload 16 byte aligned
+};
+
+static uv_mutex_t pool_lock;
+static buffer_header *free_lists[NUM_CLASSES];
+static size_t pool_bytes;
+
+static int
+size_class(size_t size, size_t *capacity)
+{
+    if (size < ((size_t)1 << MIN_SHIFT))
+        size = (size_t)1 << MIN_SHIFT;
+    if (size > ((size_t)1 << MAX_SHIFT)) {
+        *capacity = size;
+        return -1;
+    }
+
+    int shift = MIN_SHIFT;
+    while (((size_t)1 << (shift + 1)) <= size)
+        shift++;
+
+    size_t step = (size_t)1 << (shift - 2);
+    size_t units = (size + step - 1)/step; // 4 to 8
+    *capacity = units*step;
+    return (shift - MIN_SHIFT)*4 + (int)(units - 4);
+}
+
+void
+buffer_pool_init()
+{
+    uv_mutex_init(&pool_lock);
+}
+
+unsigned char *
+buffer_pool_acquire(size_t size, size_t *capacity)
+{
+    size_t cap;
+    int cls = size_class(size, &cap);
+    buffer_header *hdr = NULL;
+
+    if (cls >= 0) {
+        uv_mutex_lock(&pool_lock);
+        hdr = free_lists[cls];
+        if (hdr) {
+            free_lists[cls] = hdr->h.next;
+            pool_bytes -= cap;
+        }
+        uv_mutex_unlock(&pool_lock);
+    }
+
+    if (!hdr) {
+        hdr = (buffer_header *)malloc(sizeof(*hdr) + cap);
+        if (!hdr) return NULL;
+        hdr->h.capacity = cap;
+    }
+
+    *capacity = cap;
+    return (unsigned char *)(hdr + 1);
+}
+
+void
+buffer_pool_release(unsigned char *buf)
+{
+    if (!buf) return;
+
+    buffer_header *hdr = (buffer_header *)buf - 1;
+    size_t cap;
+    int cls = size_class(hdr->h.capacity, &cap);
+
+    if (cls >= 0 && cap == hdr->h.capacity) {
+        uv_mutex_lock(&pool_lock);
+        if (pool_bytes + cap <= POOL_MAX_BYTES) {
+            hdr->h.next = free_lists[cls];
+            free_lists[cls] = hdr;
+            pool_bytes += cap;
+            hdr = NULL;
+        }
+        uv_mutex_unlock(&pool_lock);
+    }
+
+    free(hdr);
+}
+
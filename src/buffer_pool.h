@@ -0,0 +1,20 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+
+// Recycles the memory that encoded jpegs are written to. Buffers carry their
+// capacity in a small header, so they can be handed to node as external
+// Buffers and come back here from the Buffer's free callback.
+
+void buffer_pool_init();
+
+// Returns a buffer of at least `size` bytes, its real size in `capacity`.
+unsigned char *buffer_pool_acquire(size_t size, size_t *capacity);
+
+// Returns a buffer from buffer_pool_acquire to the pool (or frees it if the
+// pool is full). NULL is ignored.
+void buffer_pool_release(unsigned char *buf);
+
+#endif
+
@@ -18,11 +18,7 @@ rgba_to_rgb(const unsigned char *rgba, int rgba_size)
     unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*rgb_size);
     if (!rgb) return NULL;
 
-    for (int i=0,j=0; i<rgba_size; i+=4,j+=3) {
-        rgb[j] = rgba[i];
-        rgb[j+1] = rgba[i+1];
-        rgb[j+2] = rgba[i+2];
-    }
+    rgba_to_rgb_row(rgba, rgb, rgba_size/4);
     return rgb;
 }
 
@@ -35,11 +31,7 @@ bgra_to_rgb(const unsigned char *bgra, int bgra_size)
     unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*rgb_size);
     if (!rgb) return NULL;
 
-    for (int i=0,j=0; i<bgra_size; i+=4,j+=3) {
-        rgb[j] = bgra[i+2];
-        rgb[j+1] = bgra[i+1];
-        rgb[j+2] = bgra[i];
-    }
+    bgra_to_rgb_row(bgra, rgb, bgra_size/4);
     return rgb;
 }
 
@@ -51,11 +43,258 @@ bgr_to_rgb(const unsigned char *bgr, int bgr_size)
     unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*bgr_size);
     if (!rgb) return NULL;
 
-    for (int i=0; i<bgr_size; i+=3) {
-        rgb[i] = bgr[i+2];
-        rgb[i+1] = bgr[i+1];
-        rgb[i+2] = bgr[i];
-    }
+    bgr_to_rgb_row(bgr, rgb, bgr_size/3);
     return rgb;
 }
 
+// Sets `pixels` RGB pixels to `color`.
+void
+fill_rgb(unsigned char *rgb, int pixels, const unsigned char *color)
+{
+    for (int i = 0; i < pixels; i++, rgb += 3) {
+        rgb[0] = color[0];
+        rgb[1] = color[1];
+        rgb[2] = color[2];
+    }
+}
+
+int
+bytes_per_pixel(buffer_type buf_type)
+{
+    return (buf_type == BUF_RGBA || buf_type == BUF_BGRA) ? 4 : 3;
+}
+
+// Maps 'rgb', 'bgr', 'rgba' or 'bgra' to a buffer_type, false for anything else.
+bool
+parse_buffer_type(const char *name, buffer_type *buf_type)
+{
+    if (str_eq(name, "rgb")) *buf_type = BUF_RGB;
+    else if (str_eq(name, "bgr")) *buf_type = BUF_BGR;
+    else if (str_eq(name, "rgba")) *buf_type = BUF_RGBA;
+    else if (str_eq(name, "bgra")) *buf_type = BUF_BGRA;
+    else return false;
+    return true;
+}
+
+// Returns NULL for BUF_RGB as no conversion is needed.
+row_converter
+rgb_row_converter(buffer_type buf_type)
+{
+    const pixel_kernels *kernels = pixel_kernels_active();
+    switch (buf_type) {
+    case BUF_RGBA: return kernels->rgba_to_rgb;
+    case BUF_BGRA: return kernels->bgra_to_rgb;
+    case BUF_BGR: return kernels->bgr_to_rgb;
+    default: return NULL;
+    }
+}
+
+void
+free_jpeg_buffer(char *data, void *hint)
+{
+    buffer_pool_release((unsigned char *)data);
+}
+
+// Hands a jpeg from buffer_pool over to a node Buffer without copying it. The
+// Buffer owns the memory afterwards and releases it when garbage collected.
+v8::Local<v8::Object>
+adopt_jpeg_buffer(char *jpeg, int jpeg_len)
+{
+    if (!jpeg)
+        return NanNewBufferHandle(0);
+    return NanNewBufferHandle(jpeg, jpeg_len, free_jpeg_buffer, NULL);
+}
+
+/*
+ * Where the bytes of a Buffer, an ArrayBuffer or a typed array on one are,
+ * so they can be read in place. The caller keeps `val` referenced for as
+ * long as it uses them. Returns false for anything else. The contents of
+ * array buffers are reached through the external elements of a typed array,
+ * which node 0.12 has. node 0.10 has no V8 array buffers at all and only
+ * Buffers work there.
+ */
+bool
+input_bytes(Handle<Value> val, unsigned char **data, size_t *len)
+{
+    if (node::Buffer::HasInstance(val)) {
+        Local<Object> buf = val->ToObject();
+        *data = (unsigned char *)node::Buffer::Data(buf);
+        *len = node::Buffer::Length(buf);
+        return true;
+    }
+
+#if NODE_MODULE_VERSION >= 14 // node 0.12
+    Local<Object> view;
+    if (val->IsArrayBuffer()) {
+        Local<ArrayBuffer> ab = val.As<ArrayBuffer>();
+        view = Uint8Array::New(ab, 0, ab->ByteLength());
+    }
+    else if (val->IsTypedArray()) {
+        view = val.As<Object>();
+    }
+    if (!view.IsEmpty() && view->HasIndexedPropertiesInExternalArrayData()) {
+        *data = (unsigned char *)view->GetIndexedPropertiesExternalArrayData();
+        *len = view.As<ArrayBufferView>()->ByteLength();
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+// Updates `opts` with the fields present in a setOptions() argument, leaving
+// the others alone. Returns an error message if the argument is unusable,
+// in which case `opts` may be partly updated.
+const char *
+parse_encoder_options(Handle<Value> val, encoder_options *opts)
+{
+    if (!val->IsObject())
+        return "Options must be an object.";
+
+    Local<Object> obj = val->ToObject();
+    Local<Value> subsampling = obj->Get(NanNew<String>("subsampling"));
+    Local<Value> dct = obj->Get(NanNew<String>("dct"));
+    Local<Value> optimize = obj->Get(NanNew<String>("optimize"));
+    Local<Value> progressive = obj->Get(NanNew<String>("progressive"));
+    Local<Value> arithmetic = obj->Get(NanNew<String>("arithmetic"));
+    Local<Value> target_width = obj->Get(NanNew<String>("targetWidth"));
+    Local<Value> target_height = obj->Get(NanNew<String>("targetHeight"));
+    Local<Value> filter = obj->Get(NanNew<String>("filter"));
+
+    if (!subsampling->IsUndefined()) {
+        if (!subsampling->IsString())
+            return "subsampling must be '444', '422', '420' or 'gray'.";
+        NanUtf8String ss(subsampling->ToString());
+        if (str_eq(*ss, "444")) opts->subsampling = SUBSAMPLING_444;
+        else if (str_eq(*ss, "422")) opts->subsampling = SUBSAMPLING_422;
+        else if (str_eq(*ss, "420")) opts->subsampling = SUBSAMPLING_420;
+        else if (str_eq(*ss, "gray")) opts->subsampling = SUBSAMPLING_GRAY;
+        else return "subsampling must be '444', '422', '420' or 'gray'.";
+    }
+
+    if (!dct->IsUndefined()) {
+        if (!dct->IsString())
+            return "dct must be 'fast', 'slow' or 'float'.";
+        NanUtf8String method(dct->ToString());
+        if (str_eq(*method, "fast")) opts->dct_method = JDCT_IFAST;
+        else if (str_eq(*method, "slow")) opts->dct_method = JDCT_ISLOW;
+#ifdef DCT_FLOAT_SUPPORTED
+        else if (str_eq(*method, "float")) opts->dct_method = JDCT_FLOAT;
+#endif
+        else return "dct must be 'fast', 'slow' or 'float'.";
+    }
+
+    if (!optimize->IsUndefined()) {
+        if (!optimize->IsBoolean())
+            return "optimize must be a boolean.";
+        opts->optimize = optimize->BooleanValue();
+    }
+
+    if (!progressive->IsUndefined()) {
+        if (!progressive->IsBoolean())
+            return "progressive must be a boolean.";
+        opts->progressive = progressive->BooleanValue();
+    }
+
+    if (!arithmetic->IsUndefined()) {
+        if (!arithmetic->IsBoolean())
+            return "arithmetic must be a boolean.";
+        opts->arithmetic = arithmetic->BooleanValue();
+#ifndef C_ARITH_CODING_SUPPORTED
+        if (opts->arithmetic)
+            return "arithmetic coding isn't supported by this libjpeg.";
+#endif
+    }
+
+    if (!target_width->IsUndefined()) {
+        if (!target_width->IsInt32() || target_width->Int32Value() < 0)
+            return "targetWidth must be a non-negative integer.";
+        opts->target_width = target_width->Int32Value();
+    }
+
+    if (!target_height->IsUndefined()) {
+        if (!target_height->IsInt32() || target_height->Int32Value() < 0)
+            return "targetHeight must be a non-negative integer.";
+        opts->target_height = target_height->Int32Value();
+    }
+
+    if (!filter->IsUndefined()) {
+        if (!filter->IsString())
+            return "filter must be 'box' or 'bilinear'.";
+        NanUtf8String name(filter->ToString());
+        if (str_eq(*name, "box")) opts->filter = RESIZE_BOX;
+        else if (str_eq(*name, "bilinear")) opts->filter = RESIZE_BILINEAR;
+        else return "filter must be 'box' or 'bilinear'.";
+    }
+
+    return NULL;
+}
+
+// Reads the {x, y, w, h, offset} descriptors of pushBatch into `fragments`,
+// checking that every fragment lies inside the width x height canvas and
+// inside the buffer of `buf_len` bytes. Returns an error message or NULL.
+const char *
+parse_push_batch(Handle<Value> val, size_t buf_len, int bpp, int width,
+    int height, std::vector<push_fragment> *fragments)
+{
+    if (!val->IsArray())
+        return "Second argument must be an array of {x, y, w, h, offset} fragments.";
+
+    Local<Array> descs = Local<Array>::Cast(val);
+    Local<String> x_key = NanNew<String>("x");
+    Local<String> y_key = NanNew<String>("y");
+    Local<String> w_key = NanNew<String>("w");
+    Local<String> h_key = NanNew<String>("h");
+    Local<String> offset_key = NanNew<String>("offset");
+
+    fragments->resize(descs->Length());
+    for (uint32_t i = 0; i < descs->Length(); i++) {
+        Local<Value> desc = descs->Get(i);
+        if (!desc->IsObject())
+            return "Fragments must be {x, y, w, h, offset} objects.";
+
+        Local<Object> obj = desc->ToObject();
+        Local<Value> x = obj->Get(x_key);
+        Local<Value> y = obj->Get(y_key);
+        Local<Value> w = obj->Get(w_key);
+        Local<Value> h = obj->Get(h_key);
+        Local<Value> offset = obj->Get(offset_key);
+        if (!x->IsInt32() || !y->IsInt32() || !w->IsInt32() || !h->IsInt32())
+            return "Fragment x, y, w and h must be integers.";
+        if (!offset->IsUint32())
+            return "Fragment offset must be a non-negative integer.";
+
+        push_fragment &f = (*fragments)[i];
+        f.x = x->Int32Value();
+        f.y = y->Int32Value();
+        f.w = w->Int32Value();
+        f.h = h->Int32Value();
+        f.offset = offset->Uint32Value();
+
+        if (f.x < 0 || f.y < 0)
+            return "Fragment coordinates smaller than 0.";
+        if (f.w < 0 || f.h < 0)
+            return "Fragment width or height smaller than 0.";
+        if (f.x >= width || f.y >= height)
+            return "Fragment coordinates exceed the stack's dimensions.";
+        if (f.w > width - f.x || f.h > height - f.y)
+            return "Fragment exceeds the stack's dimensions.";
+        if (f.offset > buf_len || (size_t)f.w*f.h*bpp > buf_len - f.offset)
+            return "Fragment exceeds the buffer.";
+    }
+    return NULL;
+}
+
+// {bytes, time} object handed to encode callbacks and lastEncodeStats().
+Local<Object>
+encode_stats_object(const encode_stats &stats)
+{
+    Local<Object> obj = NanNew<Object>();
+    obj->Set(NanNew<String>("bytes"), NanNew<Number>(stats.bytes));
+    obj->Set(NanNew<String>("time"), NanNew<Number>(stats.time));
+    obj->Set(NanNew<String>("cached"), NanNew<Boolean>(stats.cached));
+    obj->Set(NanNew<String>("quality"), NanNew<Number>(stats.quality));
+    obj->Set(NanNew<String>("trials"), NanNew<Number>(stats.trials));
+    obj->Set(NanNew<String>("overBudget"), NanNew<Boolean>(stats.over_budget));
+    return obj;
+}
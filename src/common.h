@@ -4,6 +4,12 @@
 #include <nan.h>
 #include <node.h>
 #include <cstring>
+#include <vector>
+
+#include "pixel_convert.h"
+#include "buffer_pool.h"
+#include "compressor_cache.h"
+#include "resizer.h"
 
 using v8::Handle;
 using v8::Number;
@@ -21,19 +27,80 @@ struct Rect {
     int x, y, w, h;
     Rect() {}
     Rect(int xx, int yy, int ww, int hh) : x(xx), y(yy), w(ww), h(hh) {}
-    bool isNull() { return x == 0 && y == 0 && w == 0 && h == 0; }
+    bool isNull() const { return x == 0 && y == 0 && w == 0 && h == 0; }
 };
 
 bool str_eq(const char *s1, const char *s2);
 unsigned char *rgba_to_rgb(const unsigned char *rgba, int rgba_size);
 unsigned char *bgra_to_rgb(const unsigned char *rgba, int bgra_size);
 unsigned char *bgr_to_rgb(const unsigned char *rgb, int rgb_size);
+void fill_rgb(unsigned char *rgb, int pixels, const unsigned char *color);
+
+void free_jpeg_buffer(char *data, void *hint);
+v8::Local<v8::Object> adopt_jpeg_buffer(char *jpeg, int jpeg_len);
+bool input_bytes(Handle<Value> val, unsigned char **data, size_t *len);
+
+int bytes_per_pixel(buffer_type buf_type);
+bool parse_buffer_type(const char *name, buffer_type *buf_type);
+row_converter rgb_row_converter(buffer_type buf_type);
+
+// Encoder settings set through setOptions() on Jpeg and the stacks.
+struct encoder_options {
+    chroma_subsampling subsampling;
+    J_DCT_METHOD dct_method;
+    bool optimize;    // Huffman tables computed for each image
+    bool progressive;
+    bool arithmetic;  // arithmetic instead of Huffman coding
+    int target_width, target_height; // 0 to keep the image's size
+    resize_filter filter;
+
+    encoder_options() :
+        subsampling(SUBSAMPLING_420), dct_method(JDCT_ISLOW),
+        optimize(false), progressive(false), arithmetic(false),
+        target_width(0), target_height(0), filter(RESIZE_BILINEAR) {}
+};
+
+// Size and duration of an encode, reported along with its jpeg.
+struct encode_stats {
+    unsigned long bytes;
+    double time; // milliseconds
+    bool cached; // the jpeg came from the EncodeCache
+    int quality;
+    int trials;  // compressions it took, more than one for a byte budget
+    bool over_budget; // not even quality 1 fit the byte budget
+
+    encode_stats() : bytes(0), time(0), cached(false), quality(0), trials(0),
+        over_budget(false) {}
+};
+
+const char *parse_encoder_options(Handle<Value> val, encoder_options *opts);
+v8::Local<v8::Object> encode_stats_object(const encode_stats &stats);
+
+// One fragment of pushBatch: a w x h image at byte `offset` of the batch's
+// buffer, pushed to (x, y).
+struct push_fragment {
+    int x, y, w, h;
+    size_t offset;
+};
+
+const char *parse_push_batch(Handle<Value> val, size_t buf_len, int bpp,
+    int width, int height, std::vector<push_fragment> *fragments);
 
-typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA } buffer_type;
+class JpegEncoder;
+class RowProvider;
+class PushFence;
 
 struct encode_request {
     NanCallback* callback;
     void *jpeg_obj;
+    JpegEncoder *encoder; // set up on the main thread, deleted after the callback
+    unsigned char *frame; // canvas frame the encoder reads, see FrameBuffer
+    RowProvider *rows; // what the encoder reads instead, deleted afterwards
+    PushFence *fence; // the stack's async pushes, NULL for Jpeg
+    unsigned long pushes; // pushAsync ticket the encode has to finish first
+    bool incremental; // encoder uses the stack's McuRowCache
+    Rect rect; // part of a DynamicJpegStack's canvas that is encoded
+    unsigned long max_bytes; // Jpeg's encode({maxBytes}), 0 for none
     char *jpeg;
     int jpeg_len;
     char *error;
@@ -0,0 +1,149 @@
+#include <uv.h>
+
+#include "compressor_cache.h"
+
+// Idle compressors kept around. Encodes run on the threadpool, so this is
+// about the number of encodes in flight at once.
+#define MAX_IDLE_COMPRESSORS 16
+
+static uv_mutex_t cache_lock;
+static compressor *idle; // most recently used first
+static int idle_count;
+
+bool
+compress_settings::operator==(const compress_settings &s) const
+{
+    return quality == s.quality && smoothing == s.smoothing &&
+        in_color_space == s.in_color_space &&
+        input_components == s.input_components &&
+        subsampling == s.subsampling && dct_method == s.dct_method &&
+        optimize == s.optimize && progressive == s.progressive &&
+        arithmetic == s.arithmetic;
+}
+
+static void
+configure(compressor *c, const compress_settings &settings)
+{
+    j_compress_ptr cinfo = &c->cinfo;
+
+    cinfo->input_components = settings.input_components;
+    cinfo->in_color_space = settings.in_color_space;
+
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, settings.quality, TRUE);
+    cinfo->smoothing_factor = settings.smoothing;
+    cinfo->dct_method = settings.dct_method;
+
+    // jpeg_set_defaults picked YCbCr with 2x2 sampled luma, i.e. 4:2:0
+    switch (settings.subsampling) {
+    case SUBSAMPLING_444:
+        cinfo->comp_info[0].h_samp_factor = 1;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        break;
+    case SUBSAMPLING_422:
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        break;
+    case SUBSAMPLING_GRAY:
+        jpeg_set_colorspace(cinfo, JCS_GRAYSCALE);
+        break;
+    default:
+        break;
+    }
+
+    // arithmetic coding adapts to the image by itself, libjpeg refuses to
+    // also gather Huffman statistics for it
+    cinfo->optimize_coding = settings.optimize && !settings.arithmetic;
+#ifdef C_ARITH_CODING_SUPPORTED
+    cinfo->arith_code = settings.arithmetic;
+#endif
+    // the scan script depends on the color space, so this comes last
+    if (settings.progressive)
+        jpeg_simple_progression(cinfo);
+
+    c->settings = settings;
+}
+
+// Optimized Huffman coding, which progressive mode always uses, leaves the
+// last image's tables in the compressor. jpeg_set_defaults only fills in
+// tables that don't exist yet, so they would stay for encodes that need
+// the standard ones.
+static bool
+rewrites_huffman_tables(const compress_settings &settings)
+{
+    return (settings.optimize || settings.progressive) && !settings.arithmetic;
+}
+
+void
+compressor_cache_init()
+{
+    uv_mutex_init(&cache_lock);
+}
+
+compressor *
+compressor_acquire(const compress_settings &settings)
+{
+    compressor *c = NULL;
+
+    // take the one matching `settings`, or else the least recently used one
+    uv_mutex_lock(&cache_lock);
+    compressor **pick = NULL;
+    for (compressor **it = &idle; *it; it = &(*it)->next) {
+        pick = it;
+        if ((*it)->settings == settings)
+            break;
+    }
+    if (pick) {
+        c = *pick;
+        *pick = c->next;
+        idle_count--;
+    }
+    uv_mutex_unlock(&cache_lock);
+
+    if (c && c->settings == settings)
+        return c;
+
+    if (c && rewrites_huffman_tables(c->settings) && !rewrites_huffman_tables(settings)) {
+        compressor_discard(c);
+        c = NULL;
+    }
+
+    if (!c) {
+        c = (compressor *)malloc(sizeof(*c));
+        if (!c) throw "malloc failed in compressor_acquire.";
+        c->cinfo.err = jpeg_std_error(&c->jerr);
+        jpeg_create_compress(&c->cinfo);
+    }
+    configure(c, settings);
+    return c;
+}
+
+void
+compressor_release(compressor *c)
+{
+    compressor *evict = NULL;
+
+    uv_mutex_lock(&cache_lock);
+    c->next = idle;
+    idle = c;
+    if (++idle_count > MAX_IDLE_COMPRESSORS) {
+        compressor **last = &idle;
+        while ((*last)->next)
+            last = &(*last)->next;
+        evict = *last;
+        *last = NULL;
+        idle_count--;
+    }
+    uv_mutex_unlock(&cache_lock);
+
+    if (evict)
+        compressor_discard(evict);
+}
+
+void
+compressor_discard(compressor *c)
+{
+    jpeg_destroy_compress(&c->cinfo);
+    free(c);
+}
+
@@ -0,0 +1,45 @@
+#ifndef COMPRESSOR_CACHE_H
+#define COMPRESSOR_CACHE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <jpeglib.h>
+
+typedef enum {
+    SUBSAMPLING_444, SUBSAMPLING_422, SUBSAMPLING_420, SUBSAMPLING_GRAY
+} chroma_subsampling;
+
+// Everything that jpeg_set_defaults and friends derive the compressor's
+// tables from. Compressors are only reconfigured when these change.
+struct compress_settings {
+    int quality, smoothing;
+    J_COLOR_SPACE in_color_space;
+    int input_components;
+    chroma_subsampling subsampling;
+    J_DCT_METHOD dct_method;
+    bool optimize, progressive, arithmetic;
+
+    bool operator==(const compress_settings &s) const;
+};
+
+struct compressor {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    compress_settings settings;
+    compressor *next;
+};
+
+void compressor_cache_init();
+
+// Returns an idle compressor set up for `settings`, preferring one that was
+// last used with the same settings so its tables don't have to be rebuilt.
+compressor *compressor_acquire(const compress_settings &settings);
+
+// Puts a compressor back after a successful jpeg_finish_compress.
+void compressor_release(compressor *c);
+
+// Destroys a compressor left in an unknown state, e.g. after an exception.
+void compressor_discard(compressor *c);
+
+#endif
+
@@ -8,6 +8,9 @@
 #include "common.h"
 #include "dynamic_jpeg_stack.h"
 #include "jpeg_encoder.h"
+#include "encoder_pool.h"
+#include "blit.h"
+#include "frame_source.h"
 
 using v8::Object;
 using v8::Handle;
@@ -16,36 +19,48 @@ using v8::Function;
 using v8::FunctionTemplate;
 using v8::String;
 
+Persistent<FunctionTemplate> DynamicJpegStack::constructor_template;
+
 void
 DynamicJpegStack::Initialize(v8::Handle<v8::Object> target)
 {
     NanScope();
 
     Local<FunctionTemplate> t = NanNew<FunctionTemplate>(New);
+    NanAssignPersistent(constructor_template, t);
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", JpegEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(t, "pushBatch", PushBatch);
+    NODE_SET_PROTOTYPE_METHOD(t, "pushAsync", PushAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "reset", Reset);
     NODE_SET_PROTOTYPE_METHOD(t, "setBackground", SetBackground);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSolidBackground", SetSolidBackground);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(t, "setTiled", SetTiled);
+    NODE_SET_PROTOTYPE_METHOD(t, "setOptions", SetOptions);
+    NODE_SET_PROTOTYPE_METHOD(t, "lastEncodeStats", LastEncodeStats);
     NODE_SET_PROTOTYPE_METHOD(t, "dimensions", Dimensions);
     target->Set(NanNew<String>("DynamicJpegStack"), t->GetFunction());
 }
 
 DynamicJpegStack::DynamicJpegStack(buffer_type bbuf_type) :
-    quality(60), buf_type(bbuf_type),
+    quality(60), buf_type(bbuf_type), jpeg_size_hint(0),
     dyn_rect(-1, -1, 0, 0),
-    bg_width(0), bg_height(0), data(NULL) {}
+    bg_width(0), bg_height(0),
+    solid_bg(false), frame_rect(0, 0, 0, 0),
+    tiled(false), canvas(NULL), changes(0) {}
 
 DynamicJpegStack::~DynamicJpegStack()
 {
-    free(data);
+    delete canvas;
 }
 
 void
 DynamicJpegStack::update_optimal_dimension(int x, int y, int w, int h)
 {
+    changes++;
     if (dyn_rect.x == -1 || x < dyn_rect.x)
         dyn_rect.x = x;
     if (dyn_rect.y == -1 || y < dyn_rect.y)
@@ -65,84 +80,221 @@ DynamicJpegStack::update_optimal_dimension(int x, int y, int w, int h)
         dyn_rect.h += hh;
 }
 
+// Cuts dyn_rect down to a new background, pushes to the old one may reach
+// past it.
+void
+DynamicJpegStack::clip_dyn_rect()
+{
+    if (dyn_rect.x >= bg_width || dyn_rect.y >= bg_height) {
+        dyn_rect = Rect(-1, -1, 0, 0);
+        return;
+    }
+    if (dyn_rect.x + dyn_rect.w > bg_width)
+        dyn_rect.w = bg_width - dyn_rect.x;
+    if (dyn_rect.y + dyn_rect.h > bg_height)
+        dyn_rect.h = bg_height - dyn_rect.y;
+}
+
+bool
+DynamicJpegStack::has_background() const
+{
+    return canvas || solid_bg || frame.pixels();
+}
+
+// Makes the frame of a solid background hold the given rect. Pushes pass
+// dyn_rect once it took them in: an empty push doesn't need room, but may
+// still move dyn_rect. The frame grows by half its size on the sides it has
+// to, so that pushes widening dyn_rect a little at a time don't copy the
+// frame every time.
+void
+DynamicJpegStack::cover(int x, int y, int w, int h)
+{
+    if (!solid_bg || w <= 0 || h <= 0)
+        return;
+
+    Rect &f = frame_rect;
+    bool empty = f.w <= 0 || f.h <= 0;
+    if (!empty && x >= f.x && y >= f.y && x + w <= f.x + f.w && y + h <= f.y + f.h)
+        return;
+
+    int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+    if (!empty) {
+        if (f.x < x0) x0 = f.x;
+        if (f.y < y0) y0 = f.y;
+        if (f.x + f.w > x1) x1 = f.x + f.w;
+        if (f.y + f.h > y1) y1 = f.y + f.h;
+    }
+    int slack_w = (x1 - x0)/2, slack_h = (y1 - y0)/2;
+    if (empty || x0 < f.x) x0 -= slack_w;
+    if (empty || y0 < f.y) y0 -= slack_h;
+    if (empty || x1 > f.x + f.w) x1 += slack_w;
+    if (empty || y1 > f.y + f.h) y1 += slack_h;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > bg_width) x1 = bg_width;
+    if (y1 > bg_height) y1 = bg_height;
+
+    // the old frame is copied, pending pushes have to be in it
+    fence.settle();
+
+    int nw = x1 - x0, nh = y1 - y0;
+    size_t stride = (size_t)nw*3;
+    unsigned char *data = (unsigned char *)malloc(stride*nh);
+    if (!data) throw "malloc failed in DynamicJpegStack::Push";
+
+    fill_rgb(data, nw, bg_color);
+    for (int i = 1; i < nh; i++)
+        memcpy(data + i*stride, data, stride);
+
+    if (!empty) {
+        const unsigned char *old = frame.pixels();
+        unsigned char *dst = data + (f.y - y0)*stride + (f.x - x0)*3;
+        for (int i = 0; i < f.h; i++)
+            memcpy(dst + i*stride, old + (size_t)i*f.w*3, (size_t)f.w*3);
+    }
+
+    frame.reset(data, stride*nh);
+    frame_rect = Rect(x0, y0, nw, nh);
+}
+
 Handle<Value>
 DynamicJpegStack::JpegEncodeSync()
 {
-    JpegEncoder jpeg_encoder(data, bg_width, bg_height, quality, BUF_RGB);
-    jpeg_encoder.setRect(Rect(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h));
+    if (!has_background())
+        throw "No background has been set, use setBackground or setSolidBackground to set.";
+
+    fence.settle();
+    JpegEncoder jpeg_encoder(frame.pixels(), frame_rect.w, frame_rect.h, quality, BUF_RGB);
+    jpeg_encoder.setRect(Rect(dyn_rect.x - frame_rect.x, dyn_rect.y - frame_rect.y,
+        dyn_rect.w, dyn_rect.h));
+    if (canvas)
+        jpeg_encoder.set_row_provider(canvas->rows());
+    jpeg_encoder.set_options(options);
+    jpeg_encoder.set_size_hint(jpeg_size_hint);
     jpeg_encoder.encode();
-    Handle<Object> retbuf = NanNewBufferHandle((const char*) jpeg_encoder.get_jpeg(), jpeg_encoder.get_jpeg_len());
-    return retbuf;
+    jpeg_size_hint = jpeg_encoder.get_size_hint();
+    last_stats = jpeg_encoder.get_stats();
+    int jpeg_len = jpeg_encoder.get_jpeg_len();
+    return adopt_jpeg_buffer((char *)jpeg_encoder.release_jpeg(), jpeg_len);
 }
 
 void
 DynamicJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h)
 {
-    update_optimal_dimension(x, y, w, h);
+    fence.settle();
+    if (canvas) {
+        canvas->write(data_buf, x, y, w, h, buf_type);
+        update_optimal_dimension(x, y, w, h);
+        return;
+    }
 
-    int start = y*bg_width*3 + x*3;
+    update_optimal_dimension(x, y, w, h);
+    cover(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h);
+    unsigned char *data = frame.writable();
 
-    switch (buf_type) {
-    case BUF_RGB:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-            }
-        }
-        break;
+    size_t start = ((size_t)(y - frame_rect.y)*frame_rect.w + x - frame_rect.x)*3;
+    blit_rgb(data + start, (size_t)frame_rect.w*3,
+        data_buf, (size_t)w*bytes_per_pixel(buf_type), w, h, buf_type);
+}
 
-    case BUF_BGR:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf+=3;
-            }
-        }
-        break;
+// Sets up the blits of a pushAsync. Copying tiles or the frame an encode
+// still reads, or growing the frame, first waits for the pushes before.
+void
+DynamicJpegStack::PrepareAsyncPush(unsigned char *data_buf, int x, int y,
+    int w, int h, std::vector<blit_op> *ops)
+{
+    if (canvas) {
+        if (canvas->shared(x, y, w, h))
+            fence.settle();
+        canvas->prepare_write(data_buf, x, y, w, h, buf_type, ops);
+        update_optimal_dimension(x, y, w, h);
+        return;
+    }
 
-    case BUF_RGBA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                data_buf++;
-            }
-        }
-        break;
+    if (frame.shared())
+        fence.settle();
+    update_optimal_dimension(x, y, w, h);
+    cover(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h);
+    unsigned char *data = frame.writable();
+
+    blit_op op;
+    op.dst = data + ((size_t)(y - frame_rect.y)*frame_rect.w + x - frame_rect.x)*3;
+    op.dst_stride = (size_t)frame_rect.w*3;
+    op.src = data_buf;
+    op.src_stride = (size_t)w*bytes_per_pixel(buf_type);
+    op.w = w;
+    op.h = h;
+    ops->push_back(op);
+}
 
-    case BUF_BGRA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf += 4;
-            }
+// Pushes all fragments at once. dyn_rect, and the frame of a solid
+// background, grow once to the bounds of the batch.
+void
+DynamicJpegStack::PushBatch(unsigned char *data_buf,
+    const std::vector<push_fragment> &fragments)
+{
+    if (fragments.empty())
+        return;
+    fence.settle();
+
+    int x0 = fragments[0].x, y0 = fragments[0].y;
+    int x1 = x0 + fragments[0].w, y1 = y0 + fragments[0].h;
+    for (size_t i = 1; i < fragments.size(); i++) {
+        const push_fragment &f = fragments[i];
+        if (f.x < x0) x0 = f.x;
+        if (f.y < y0) y0 = f.y;
+        if (f.x + f.w > x1) x1 = f.x + f.w;
+        if (f.y + f.h > y1) y1 = f.y + f.h;
+    }
+
+    int bpp = bytes_per_pixel(buf_type);
+    unsigned char *data = NULL;
+    update_optimal_dimension(x0, y0, x1 - x0, y1 - y0);
+    if (!canvas) {
+        cover(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h);
+        data = frame.writable();
+    }
+
+    for (size_t i = 0; i < fragments.size(); i++) {
+        const push_fragment &f = fragments[i];
+        if (canvas) {
+            canvas->write(data_buf + f.offset, f.x, f.y, f.w, f.h, buf_type);
+            continue;
         }
-        break;
-
-    default:
-        throw "Unexpected buf_type in DynamicJpegStack::Push";
+        size_t start = ((size_t)(f.y - frame_rect.y)*frame_rect.w + f.x - frame_rect.x)*3;
+        blit_rgb(data + start, (size_t)frame_rect.w*3,
+            data_buf + f.offset, (size_t)f.w*bpp, f.w, f.h, buf_type);
     }
 }
 
 void
 DynamicJpegStack::SetBackground(unsigned char *data_buf, int w, int h)
 {
-    if (data) {
-        free(data);
-        data = NULL;
+    fence.settle();
+    changes++;
+    if (tiled) {
+        static const unsigned char black[3] = { 0, 0, 0 };
+        TiledCanvas *bg = new TiledCanvas(w, h, black);
+        try {
+            bg->write(data_buf, 0, 0, w, h, buf_type);
+        }
+        catch (...) {
+            delete bg;
+            throw;
+        }
+        delete canvas;
+        canvas = bg;
+        frame.reset(NULL, 0);
+        bg_width = w;
+        bg_height = h;
+        solid_bg = false;
+        frame_rect = Rect(0, 0, w, h);
+        clip_dyn_rect();
+        return;
     }
 
+    unsigned char *data;
+
     switch (buf_type) {
     case BUF_RGB:
         data = (unsigned char *)malloc(sizeof(*data)*w*h*3);
@@ -168,30 +320,89 @@ DynamicJpegStack::SetBackground(unsigned char *data_buf, int w, int h)
     default:
         throw "Unexpected buf_type in DynamicJpegStack::SetBackground";
     }
+    delete canvas;
+    canvas = NULL;
+    frame.reset(data, w*h*3);
+    bg_width = w;
+    bg_height = h;
+    solid_bg = false;
+    frame_rect = Rect(0, 0, w, h);
+    clip_dyn_rect();
+}
+
+// Only the color is kept, the frame holds just the part pushes went to.
+void
+DynamicJpegStack::SetSolidBackground(unsigned char r, unsigned char g,
+    unsigned char b, int w, int h)
+{
+    bg_color[0] = r;
+    bg_color[1] = g;
+    bg_color[2] = b;
+
+    fence.settle();
+    changes++;
+    delete canvas;
+    canvas = NULL;
+    frame.reset(NULL, 0);
     bg_width = w;
     bg_height = h;
+    clip_dyn_rect();
+
+    if (tiled) {
+        canvas = new TiledCanvas(w, h, bg_color);
+        solid_bg = false;
+        frame_rect = Rect(0, 0, w, h);
+        return;
+    }
+
+    solid_bg = true;
+    frame_rect = Rect(0, 0, 0, 0);
+    cover(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h);
 }
 
 void
 DynamicJpegStack::SetQuality(int q)
 {
     quality = q;
+    changes++;
+}
+
+// Takes effect with the next setBackground or setSolidBackground.
+void
+DynamicJpegStack::SetTiled(bool t)
+{
+    tiled = t;
+    changes++;
+}
+
+void
+DynamicJpegStack::SetOptions(const encoder_options &opts)
+{
+    options = opts;
+    changes++;
 }
 
 void
 DynamicJpegStack::Reset()
 {
     dyn_rect = Rect(-1, -1, 0, 0);
+    changes++;
 }
 
 Handle<Value>
 DynamicJpegStack::Dimensions()
+{
+    return Dimensions(dyn_rect);
+}
+
+Handle<Value>
+DynamicJpegStack::Dimensions(const Rect &r)
 {
     Handle<Object> dim = NanNew<Object>();
-    dim->Set(NanNew<String>("x"), NanNew<Number>(dyn_rect.x));
-    dim->Set(NanNew<String>("y"), NanNew<Number>(dyn_rect.y));
-    dim->Set(NanNew<String>("width"), NanNew<Number>(dyn_rect.w));
-    dim->Set(NanNew<String>("height"), NanNew<Number>(dyn_rect.h));
+    dim->Set(NanNew<String>("x"), NanNew<Number>(r.x));
+    dim->Set(NanNew<String>("y"), NanNew<Number>(r.y));
+    dim->Set(NanNew<String>("width"), NanNew<Number>(r.w));
+    dim->Set(NanNew<String>("height"), NanNew<Number>(r.h));
     return dim;
 }
 
@@ -251,62 +462,207 @@ NAN_METHOD(DynamicJpegStack::Push)
     NanScope();
 
     if (args.Length() != 5) {
-        NanThrowError("Five arguments required - buffer, x, y, width, height.");
+        return NanThrowError("Five arguments required - buffer, x, y, width, height.");
     }
 
-    if (!node::Buffer::HasInstance(args[0])) {
-        NanThrowError("First argument must be Buffer.");
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
     }
     if (!args[1]->IsInt32()) {
-        NanThrowError("Second argument must be integer x.");
+        return NanThrowError("Second argument must be integer x.");
     }
     if (!args[2]->IsInt32()) {
-        NanThrowError("Third argument must be integer y.");
+        return NanThrowError("Third argument must be integer y.");
     }
     if (!args[3]->IsInt32()) {
-        NanThrowError("Fourth argument must be integer w.");
+        return NanThrowError("Fourth argument must be integer w.");
     }
     if (!args[4]->IsInt32()) {
-        NanThrowError("Fifth argument must be integer h.");
+        return NanThrowError("Fifth argument must be integer h.");
     }
 
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
 
-    if (!jpeg->data)
-        NanThrowError("No background has been set, use setBackground or setSolidBackground to set.");
+    if (!jpeg->has_background())
+        return NanThrowError("No background has been set, use setBackground or setSolidBackground to set.");
 
-    Local<Object> data_buf = args[0]->ToObject();
     int x = args[1]->Int32Value();
     int y = args[2]->Int32Value();
     int w = args[3]->Int32Value();
     int h = args[4]->Int32Value();
 
     if (x < 0) {
-        NanThrowError("Coordinate x smaller than 0.");
+        return NanThrowError("Coordinate x smaller than 0.");
     }
     if (y < 0) {
-        NanThrowError("Coordinate y smaller than 0.");
+        return NanThrowError("Coordinate y smaller than 0.");
     }
     if (w < 0) {
-        NanThrowError("Width smaller than 0.");
+        return NanThrowError("Width smaller than 0.");
     }
     if (h < 0) {
-        NanThrowError("Height smaller than 0.");
+        return NanThrowError("Height smaller than 0.");
     }
     if (x >= jpeg->bg_width) {
-        NanThrowError("Coordinate x exceeds DynamicJpegStack's background dimensions.");
+        return NanThrowError("Coordinate x exceeds DynamicJpegStack's background dimensions.");
     }
     if (y >= jpeg->bg_height) {
-        NanThrowError("Coordinate y exceeds DynamicJpegStack's background dimensions.");
+        return NanThrowError("Coordinate y exceeds DynamicJpegStack's background dimensions.");
     }
     if (x+w > jpeg->bg_width) {
-        NanThrowError("Pushed fragment exceeds DynamicJpegStack's width.");
+        return NanThrowError("Pushed fragment exceeds DynamicJpegStack's width.");
     }
     if (y+h > jpeg->bg_height) {
-        NanThrowError("Pushed fragment exceeds DynamicJpegStack's height.");
+        return NanThrowError("Pushed fragment exceeds DynamicJpegStack's height.");
+    }
+
+    if ((size_t)w*h*bytes_per_pixel(jpeg->buf_type) > len) {
+        return NanThrowError("Buffer is smaller than the fragment.");
+    }
+
+    try {
+        jpeg->Push(data, x, y, w, h);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::PushAsync)
+{
+    NanScope();
+
+    if (args.Length() < 5) {
+        return NanThrowError("At least five arguments required - buffer, x, y, width, height, [and callback].");
+    }
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
+    }
+    if (!args[1]->IsInt32()) {
+        return NanThrowError("Second argument must be integer x.");
+    }
+    if (!args[2]->IsInt32()) {
+        return NanThrowError("Third argument must be integer y.");
+    }
+    if (!args[3]->IsInt32()) {
+        return NanThrowError("Fourth argument must be integer w.");
+    }
+    if (!args[4]->IsInt32()) {
+        return NanThrowError("Fifth argument must be integer h.");
+    }
+    if (args.Length() > 5 && !args[5]->IsFunction()) {
+        return NanThrowError("Sixth argument must be a function.");
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+
+    if (!jpeg->has_background())
+        return NanThrowError("No background has been set, use setBackground or setSolidBackground to set.");
+
+    int x = args[1]->Int32Value();
+    int y = args[2]->Int32Value();
+    int w = args[3]->Int32Value();
+    int h = args[4]->Int32Value();
+
+    if (x < 0 || y < 0) {
+        return NanThrowError("Coordinates smaller than 0.");
+    }
+    if (w < 0 || h < 0) {
+        return NanThrowError("Width or height smaller than 0.");
+    }
+    if (x >= jpeg->bg_width || y >= jpeg->bg_height) {
+        return NanThrowError("Coordinates exceed DynamicJpegStack's background dimensions.");
+    }
+    if (w > jpeg->bg_width - x || h > jpeg->bg_height - y) {
+        return NanThrowError("Pushed fragment exceeds DynamicJpegStack's dimensions.");
+    }
+    if ((size_t)w*h*bytes_per_pixel(jpeg->buf_type) > len) {
+        return NanThrowError("Buffer is smaller than the fragment.");
+    }
+
+    if (EncoderPool::full()) {
+        return NanThrowError("Encoder queue is full.");
+    }
+
+    push_request *push_req = new push_request;
+    try {
+        jpeg->PrepareAsyncPush(data, x, y, w, h, &push_req->ops);
+    }
+    catch (const char *err) {
+        delete push_req;
+        return NanThrowError(err);
+    }
+
+    push_req->callback = args.Length() > 5 ?
+        new NanCallback(args[5].As<Function>()) : NULL;
+    push_req->stack = jpeg;
+    NanAssignPersistent(push_req->buffer, args[0]->ToObject());
+    push_req->buf_type = jpeg->buf_type;
+    push_req->fence = &jpeg->fence;
+    jpeg->fence.issue(push_req);
+
+    uv_work_t* req = new uv_work_t;
+    req->data = push_req;
+    EncoderPool::queue(req, UV_PushAsync, UV_PushAsyncAfter);
+    jpeg->Ref();
+
+    NanReturnUndefined();
+}
+
+void
+DynamicJpegStack::UV_PushAsync(uv_work_t *req)
+{
+    run_push((push_request *)req->data);
+}
+
+void
+DynamicJpegStack::UV_PushAsyncAfter(uv_work_t *req)
+{
+    push_request *push_req = (push_request *)req->data;
+    delete req;
+    DynamicJpegStack *jpeg = (DynamicJpegStack *)push_req->stack;
+
+    finish_push(push_req);
+    jpeg->Unref();
+}
+
+NAN_METHOD(DynamicJpegStack::PushBatch)
+{
+    NanScope();
+
+    if (args.Length() != 2) {
+        return NanThrowError("Two arguments required - buffer and fragments.");
+    }
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+
+    if (!jpeg->has_background())
+        return NanThrowError("No background has been set, use setBackground or setSolidBackground to set.");
+
+    std::vector<push_fragment> fragments;
+    const char *err = parse_push_batch(args[1], len,
+        bytes_per_pixel(jpeg->buf_type), jpeg->bg_width, jpeg->bg_height, &fragments);
+    if (err) {
+        return NanThrowError(err);
     }
 
-    jpeg->Push((unsigned char *)node::Buffer::Data(data_buf), x, y, w, h);
+    try {
+        jpeg->PushBatch(data, fragments);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
 
     NanReturnUndefined();
 }
@@ -316,29 +672,67 @@ NAN_METHOD(DynamicJpegStack::SetBackground)
     NanScope();
 
     if (args.Length() != 3)
-        NanThrowError("Four arguments required - buffer, width, height");
-    if (!node::Buffer::HasInstance(args[0]))
-        NanThrowError("First argument must be Buffer.");
+        return NanThrowError("Four arguments required - buffer, width, height");
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len))
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
     if (!args[1]->IsInt32())
-        NanThrowError("Second argument must be integer width.");
+        return NanThrowError("Second argument must be integer width.");
     if (!args[2]->IsInt32())
-        NanThrowError("Third argument must be integer height.");
+        return NanThrowError("Third argument must be integer height.");
 
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
-    Local<Object> data_buf = args[0]->ToObject();
     int w = args[1]->Int32Value();
     int h = args[2]->Int32Value();
 
     if (w < 0)
-        NanThrowError("Coordinate x smaller than 0.");
+        return NanThrowError("Coordinate x smaller than 0.");
     if (h < 0)
-        NanThrowError("Coordinate y smaller than 0.");
+        return NanThrowError("Coordinate y smaller than 0.");
+    if ((size_t)w*h*bytes_per_pixel(jpeg->buf_type) > len)
+        return NanThrowError("Buffer is smaller than width*height pixels.");
 
     try {
-        jpeg->SetBackground((unsigned char *)node::Buffer::Data(data_buf), w, h);
+        jpeg->SetBackground(data, w, h);
     }
     catch (const char *err) {
-        NanThrowError(err);
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::SetSolidBackground)
+{
+    NanScope();
+
+    if (args.Length() != 5)
+        return NanThrowError("Five arguments required - r, g, b, width, height");
+    for (int i = 0; i < 3; i++) {
+        if (!args[i]->IsInt32() || args[i]->Int32Value() < 0 || args[i]->Int32Value() > 255)
+            return NanThrowError("Color components must be integers from 0 to 255.");
+    }
+    if (!args[3]->IsInt32())
+        return NanThrowError("Fourth argument must be integer width.");
+    if (!args[4]->IsInt32())
+        return NanThrowError("Fifth argument must be integer height.");
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    int w = args[3]->Int32Value();
+    int h = args[4]->Int32Value();
+
+    if (w < 0)
+        return NanThrowError("Width smaller than 0.");
+    if (h < 0)
+        return NanThrowError("Height smaller than 0.");
+
+    try {
+        jpeg->SetSolidBackground(args[0]->Int32Value(), args[1]->Int32Value(),
+            args[2]->Int32Value(), w, h);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
     }
 
     NanReturnUndefined();
@@ -388,30 +782,105 @@ NAN_METHOD(DynamicJpegStack::SetQuality)
     NanReturnUndefined();
 }
 
-void
-DynamicJpegStack::UV_JpegEncode(uv_work_t *req)
+NAN_METHOD(DynamicJpegStack::SetTiled)
 {
-    encode_request *enc_req = (encode_request *)req->data;
-    DynamicJpegStack *jpeg = (DynamicJpegStack *)enc_req->jpeg_obj;
+    NanScope();
 
-    try {
-        Rect &dyn_rect = jpeg->dyn_rect;
-        JpegEncoder encoder(jpeg->data, jpeg->bg_width, jpeg->bg_height, jpeg->quality, BUF_RGB);
-        encoder.setRect(Rect(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h));
-        encoder.encode();
-        enc_req->jpeg_len = encoder.get_jpeg_len();
-        enc_req->jpeg = (char *)malloc(sizeof(*enc_req->jpeg)*enc_req->jpeg_len);
-        if (!enc_req->jpeg) {
-            enc_req->error = strdup("malloc in DynamicJpegStack::UV_JpegEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->jpeg, encoder.get_jpeg(), enc_req->jpeg_len);
-        }
+    if (args.Length() != 1) {
+        return NanThrowError("One argument required - true or false");
     }
-    catch (const char *err) {
-        enc_req->error = strdup(err);
+
+    if (!args[0]->IsBoolean()) {
+        return NanThrowError("First argument must be a boolean");
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    jpeg->SetTiled(args[0]->BooleanValue());
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::SetOptions)
+{
+    NanScope();
+
+    if (args.Length() != 1) {
+        return NanThrowError("One argument required - options object {subsampling, dct}");
     }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    encoder_options opts = jpeg->options;
+    const char *err = parse_encoder_options(args[0], &opts);
+    if (err) {
+        return NanThrowError(err);
+    }
+    jpeg->SetOptions(opts);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::LastEncodeStats)
+{
+    NanScope();
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    NanReturnValue(encode_stats_object(jpeg->last_stats));
+}
+
+unsigned long
+DynamicJpegStack::generation() const
+{
+    return changes;
+}
+
+encode_request *
+DynamicJpegStack::begin_encode()
+{
+    if (!has_background())
+        throw "No background has been set, use setBackground or setSolidBackground to set.";
+
+    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
+    if (!enc_req)
+        throw "malloc in DynamicJpegStack::JpegEncodeAsync failed.";
+
+    enc_req->callback = NULL;
+    enc_req->jpeg_obj = this;
+    enc_req->frame = canvas ? NULL : frame.freeze();
+    enc_req->rows = canvas ? canvas->snapshot(dyn_rect) : NULL;
+    enc_req->fence = &fence;
+    enc_req->pushes = fence.last();
+    enc_req->incremental = false;
+    enc_req->max_bytes = 0;
+    enc_req->encoder = new JpegEncoder(enc_req->frame, frame_rect.w, frame_rect.h, quality, BUF_RGB);
+    enc_req->encoder->setRect(Rect(dyn_rect.x - frame_rect.x, dyn_rect.y - frame_rect.y,
+        dyn_rect.w, dyn_rect.h));
+    enc_req->encoder->set_row_provider(enc_req->rows);
+    enc_req->rect = dyn_rect;
+    enc_req->encoder->set_options(options);
+    enc_req->encoder->set_size_hint(jpeg_size_hint);
+    enc_req->jpeg = NULL;
+    enc_req->jpeg_len = 0;
+    enc_req->error = NULL;
+    return enc_req;
+}
+
+void
+DynamicJpegStack::end_encode(encode_request *enc_req)
+{
+    jpeg_size_hint = enc_req->encoder->get_size_hint();
+    last_stats = enc_req->encoder->get_stats();
+    if (enc_req->rows)
+        delete enc_req->rows;
+    else
+        frame.thaw(enc_req->frame);
+    delete enc_req->encoder;
+    enc_req->encoder = NULL;
+}
+
+void
+DynamicJpegStack::UV_JpegEncode(uv_work_t *req)
+{
+    run_encode((encode_request *)req->data);
 }
 
 void 
@@ -422,25 +891,29 @@ DynamicJpegStack::UV_JpegEncodeAfter(uv_work_t *req)
     encode_request *enc_req = (encode_request *)req->data;
     delete req;
     DynamicJpegStack *jpeg = (DynamicJpegStack *)enc_req->jpeg_obj;
+    jpeg->end_encode(enc_req);
 
-    Handle<Value> argv[3];
+    Handle<Value> argv[4];
 
     if (enc_req->error) {
         argv[0] = NanUndefined();
         argv[1] = NanUndefined();
         argv[2] = NanError(enc_req->error);
+        argv[3] = NanUndefined();
     }
     else {
-        Handle<Object> buf = NanNewBufferHandle(enc_req->jpeg, enc_req->jpeg_len);
+        Handle<Object> buf = adopt_jpeg_buffer(enc_req->jpeg, enc_req->jpeg_len);
+        enc_req->jpeg = NULL; // owned by buf now
         argv[0] = buf;
-        argv[1] = jpeg->Dimensions();
+        argv[1] = jpeg->Dimensions(enc_req->rect);
         argv[2] = NanUndefined();
+        argv[3] = encode_stats_object(jpeg->last_stats);
     }
 
-    enc_req->callback->Call(3, argv);
+    enc_req->callback->Call(4, argv);
 
     delete enc_req->callback;
-    free(enc_req->jpeg);
+    buffer_pool_release((unsigned char *)enc_req->jpeg);
     free(enc_req->error);
 
     jpeg->Unref();
@@ -462,20 +935,22 @@ NAN_METHOD(DynamicJpegStack::JpegEncodeAsync)
     Local<Function> callback = Local<Function>::Cast(args[0]);
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
 
-    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
-    if (!enc_req) {
-        NanThrowError("malloc in DynamicJpegStack::JpegEncodeAsync failed.");
+    if (EncoderPool::full()) {
+        return NanThrowError("Encoder queue is full.");
     }
 
+    encode_request *enc_req;
+    try {
+        enc_req = jpeg->begin_encode();
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
     enc_req->callback = new NanCallback(callback);
-    enc_req->jpeg_obj = jpeg;
-    enc_req->jpeg = NULL;
-    enc_req->jpeg_len = 0;
-    enc_req->error = NULL;
 
     uv_work_t* req = new uv_work_t;
     req->data = enc_req;
-    uv_queue_work(uv_default_loop(), req, UV_JpegEncode, (uv_after_work_cb)UV_JpegEncodeAfter);
+    EncoderPool::queue(req, UV_JpegEncode, UV_JpegEncodeAfter);
 
     jpeg->Ref();
 
@@ -9,38 +9,83 @@
 
 #include "common.h"
 #include "jpeg_encoder.h"
+#include "frame_buffer.h"
+#include "tiled_canvas.h"
+#include "async_push.h"
+#include "frame_source.h"
 
-class DynamicJpegStack : public node::ObjectWrap {
+class DynamicJpegStack : public node::ObjectWrap, public FrameSource {
     int quality;
     buffer_type buf_type;
+    unsigned long jpeg_size_hint; // predicted size of the next jpeg
+    encoder_options options;
+    encode_stats last_stats;
 
-    unsigned char *data;
+    FrameBuffer frame;
 
     int bg_width, bg_height; // background width and height after setBackground
     Rect dyn_rect; // rect of dynamic push area (updated after each push)
 
+    // With a solid background the frame only holds frame_rect of it, grown
+    // as pushes need. After setBackground it's the whole background.
+    bool solid_bg;
+    unsigned char bg_color[3];
+    Rect frame_rect;
+
+    bool tiled; // backgrounds set from now on go to a TiledCanvas
+    TiledCanvas *canvas; // used instead of the frame, or NULL
+
+    PushFence fence; // orders pushAsync with everything else
+    unsigned long changes; // pushes, background and settings, see generation()
+
     void update_optimal_dimension(int x, int y, int w, int h);
+    void cover(int x, int y, int w, int h);
+    void clip_dyn_rect();
+    bool has_background() const;
+    void PrepareAsyncPush(unsigned char *data_buf, int x, int y, int w, int h,
+        std::vector<blit_op> *ops);
+    v8::Handle<v8::Value> Dimensions(const Rect &r);
 
     static void UV_JpegEncode(uv_work_t *req);
     static void UV_JpegEncodeAfter(uv_work_t *req);
+    static void UV_PushAsync(uv_work_t *req);
+    static void UV_PushAsyncAfter(uv_work_t *req);
 public:
     DynamicJpegStack(buffer_type bbuf_type);
     ~DynamicJpegStack();
 
     v8::Handle<v8::Value> JpegEncodeSync();
     void Push(unsigned char *data_buf, int x, int y, int w, int h);
+    void PushBatch(unsigned char *data_buf,
+        const std::vector<push_fragment> &fragments);
     void SetBackground(unsigned char *data_buf, int w, int h);
+    void SetSolidBackground(unsigned char r, unsigned char g, unsigned char b,
+        int w, int h);
     void SetQuality(int q);
+    void SetTiled(bool t);
+    void SetOptions(const encoder_options &opts);
     v8::Handle<v8::Value> Dimensions();
     void Reset();
 
+    unsigned long generation() const;
+    encode_request *begin_encode();
+    void end_encode(encode_request *enc_req);
+
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
     static void Initialize(v8::Handle<v8::Object> target);
     static NAN_METHOD(New);
     static NAN_METHOD(JpegEncodeSync);
     static NAN_METHOD(JpegEncodeAsync);
     static NAN_METHOD(Push);
+    static NAN_METHOD(PushBatch);
+    static NAN_METHOD(PushAsync);
     static NAN_METHOD(SetBackground);
+    static NAN_METHOD(SetSolidBackground);
     static NAN_METHOD(SetQuality);
+    static NAN_METHOD(SetTiled);
+    static NAN_METHOD(SetOptions);
+    static NAN_METHOD(LastEncodeStats);
     static NAN_METHOD(Dimensions);
     static NAN_METHOD(Reset);
 };
@@ -0,0 +1,268 @@
+#include <nan.h>
+#include <node.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "encode_cache.h"
+#include "buffer_pool.h"
+
+using v8::Object;
+using v8::Handle;
+using v8::Local;
+using v8::Value;
+using v8::String;
+using v8::Number;
+
+#define MIN_BUCKETS 256
+
+// An entry and its jpeg are one allocation, the jpeg follows the entry.
+struct cache_entry {
+    encode_cache_key key;
+    unsigned long jpeg_len;
+    cache_entry *hash_next;
+    cache_entry *lru_prev, *lru_next; // most recently used at lru_head
+};
+
+static uv_mutex_t lock;
+static cache_entry **buckets;
+static size_t bucket_count;
+static cache_entry *lru_head, *lru_tail;
+
+static size_t max_bytes; // 0 means disabled
+static size_t bytes;     // jpegs and entries
+static size_t entries;
+static double hits, misses, evictions;
+
+static bool
+key_eq(const encode_cache_key &a, const encode_cache_key &b)
+{
+    const encoder_options &o = a.options, &p = b.options;
+    return a.hash == b.hash && a.width == b.width && a.height == b.height &&
+        a.quality == b.quality && a.smoothing == b.smoothing &&
+        a.buf_type == b.buf_type && a.parallel == b.parallel &&
+        a.rect.x == b.rect.x && a.rect.y == b.rect.y &&
+        a.rect.w == b.rect.w && a.rect.h == b.rect.h &&
+        o.subsampling == p.subsampling && o.dct_method == p.dct_method &&
+        o.optimize == p.optimize && o.progressive == p.progressive &&
+        o.arithmetic == p.arithmetic && o.target_width == p.target_width &&
+        o.target_height == p.target_height && o.filter == p.filter;
+}
+
+static size_t
+entry_size(const cache_entry *e)
+{
+    return sizeof(*e) + e->jpeg_len;
+}
+
+static cache_entry **
+bucket_of(uint64_t hash)
+{
+    return &buckets[hash & (bucket_count - 1)];
+}
+
+static void
+lru_unlink(cache_entry *e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else lru_tail = e->lru_prev;
+}
+
+static void
+lru_push_front(cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = e;
+    else lru_tail = e;
+    lru_head = e;
+}
+
+// Removes and frees `e`, called with the lock held.
+static void
+remove_entry(cache_entry *e)
+{
+    cache_entry **p = bucket_of(e->key.hash);
+    while (*p != e)
+        p = &(*p)->hash_next;
+    *p = e->hash_next;
+
+    lru_unlink(e);
+    bytes -= entry_size(e);
+    entries--;
+    free(e);
+}
+
+// Drops least recently used entries until `needed` more bytes fit.
+static void
+evict(size_t needed)
+{
+    while (lru_tail && bytes + needed > max_bytes) {
+        remove_entry(lru_tail);
+        evictions++;
+    }
+}
+
+// Doubles the bucket array once there are twice as many entries as buckets.
+static void
+grow_buckets()
+{
+    if (bucket_count && entries <= 2*bucket_count)
+        return;
+
+    size_t count = bucket_count ? 2*bucket_count : MIN_BUCKETS;
+    cache_entry **grown = (cache_entry **)calloc(count, sizeof(*grown));
+    if (!grown)
+        return; // longer chains, still correct
+
+    for (size_t i = 0; i < bucket_count; i++) {
+        cache_entry *e = buckets[i];
+        while (e) {
+            cache_entry *next = e->hash_next;
+            cache_entry **b = &grown[e->key.hash & (count - 1)];
+            e->hash_next = *b;
+            *b = e;
+            e = next;
+        }
+    }
+    free(buckets);
+    buckets = grown;
+    bucket_count = count;
+}
+
+void
+EncodeCache::Initialize(Handle<Object> target)
+{
+    NanScope();
+
+    uv_mutex_init(&lock);
+
+    NODE_SET_METHOD(target, "configureEncodeCache", Configure);
+    NODE_SET_METHOD(target, "encodeCacheStats", Stats);
+}
+
+bool
+EncodeCache::enabled()
+{
+    uv_mutex_lock(&lock);
+    bool ret = max_bytes > 0;
+    uv_mutex_unlock(&lock);
+    return ret;
+}
+
+bool
+EncodeCache::lookup(const encode_cache_key &key, unsigned char **jpeg,
+    unsigned long *jpeg_len)
+{
+    uv_mutex_lock(&lock);
+
+    cache_entry *e = bucket_count ? *bucket_of(key.hash) : NULL;
+    while (e && !key_eq(e->key, key))
+        e = e->hash_next;
+
+    unsigned char *copy = NULL;
+    size_t capacity;
+    if (e)
+        copy = buffer_pool_acquire(e->jpeg_len, &capacity);
+
+    if (copy) {
+        memcpy(copy, e + 1, e->jpeg_len);
+        *jpeg = copy;
+        *jpeg_len = e->jpeg_len;
+        lru_unlink(e);
+        lru_push_front(e);
+        hits++;
+    }
+    else {
+        misses++;
+    }
+
+    uv_mutex_unlock(&lock);
+    return copy != NULL;
+}
+
+void
+EncodeCache::insert(const encode_cache_key &key, const unsigned char *jpeg,
+    unsigned long jpeg_len)
+{
+    size_t size = sizeof(cache_entry) + jpeg_len;
+
+    uv_mutex_lock(&lock);
+
+    // another thread may have encoded the same image meanwhile
+    cache_entry *e = bucket_count ? *bucket_of(key.hash) : NULL;
+    while (e && !key_eq(e->key, key))
+        e = e->hash_next;
+
+    if (e || size > max_bytes) {
+        uv_mutex_unlock(&lock);
+        return;
+    }
+
+    evict(size);
+    grow_buckets();
+
+    e = (cache_entry *)malloc(size);
+    if (e && bucket_count) {
+        e->key = key;
+        e->jpeg_len = jpeg_len;
+        memcpy(e + 1, jpeg, jpeg_len);
+
+        cache_entry **b = bucket_of(key.hash);
+        e->hash_next = *b;
+        *b = e;
+        lru_push_front(e);
+        bytes += size;
+        entries++;
+    }
+    else {
+        free(e);
+    }
+
+    uv_mutex_unlock(&lock);
+}
+
+NAN_METHOD(EncodeCache::Configure)
+{
+    NanScope();
+
+    if (args.Length() != 1 || !args[0]->IsObject()) {
+        return NanThrowError("One argument required - options object {maxBytes}.");
+    }
+
+    Local<Object> opts = args[0]->ToObject();
+    Local<Value> maxb = opts->Get(NanNew<String>("maxBytes"));
+
+    if (!maxb->IsUndefined() && (!maxb->IsNumber() || maxb->NumberValue() < 0)) {
+        return NanThrowError("maxBytes must be a non-negative number, 0 to disable the cache.");
+    }
+
+    uv_mutex_lock(&lock);
+    if (!maxb->IsUndefined()) {
+        max_bytes = (size_t)maxb->NumberValue();
+        evict(0);
+    }
+    uv_mutex_unlock(&lock);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(EncodeCache::Stats)
+{
+    NanScope();
+
+    uv_mutex_lock(&lock);
+    double nhits = hits, nmisses = misses, nevictions = evictions;
+    double nentries = entries, nbytes = bytes, nmax = max_bytes;
+    uv_mutex_unlock(&lock);
+
+    Local<Object> stats = NanNew<Object>();
+    stats->Set(NanNew<String>("hits"), NanNew<Number>(nhits));
+    stats->Set(NanNew<String>("misses"), NanNew<Number>(nmisses));
+    stats->Set(NanNew<String>("evictions"), NanNew<Number>(nevictions));
+    stats->Set(NanNew<String>("entries"), NanNew<Number>(nentries));
+    stats->Set(NanNew<String>("bytes"), NanNew<Number>(nbytes));
+    stats->Set(NanNew<String>("maxBytes"), NanNew<Number>(nmax));
+    NanReturnValue(stats);
+}
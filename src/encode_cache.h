@@ -0,0 +1,42 @@
+#ifndef ENCODE_CACHE_H
+#define ENCODE_CACHE_H
+
+#include <nan.h>
+#include <node.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Everything the output of an encode depends on.
+struct encode_cache_key {
+    uint64_t hash; // pixel_hash of the input pixels
+    int width, height, quality, smoothing;
+    buffer_type buf_type;
+    bool parallel; // striped encodes contain restart markers
+    Rect rect;
+    encoder_options options;
+};
+
+/*
+ * Jpegs of recent encodes, looked up by a hash of their input pixels and
+ * the encoder settings, so that encoding an image that was encoded before
+ * is a hash and a copy. Least recently used jpegs are dropped to stay
+ * within the byte budget, which is 0 (disabled) until configured.
+ */
+class EncodeCache {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    static bool enabled();
+
+    // On a hit, copies the jpeg to a buffer from buffer_pool and returns true.
+    static bool lookup(const encode_cache_key &key, unsigned char **jpeg,
+        unsigned long *jpeg_len);
+    static void insert(const encode_cache_key &key, const unsigned char *jpeg,
+        unsigned long jpeg_len);
+
+    static NAN_METHOD(Configure);
+    static NAN_METHOD(Stats);
+};
+
+#endif
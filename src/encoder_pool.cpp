@@ -0,0 +1,393 @@
+#include <nan.h>
+#include <node.h>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "encoder_pool.h"
+
+using v8::Object;
+using v8::Handle;
+using v8::Local;
+using v8::Value;
+using v8::String;
+using v8::Number;
+
+#define MAX_THREADS 64
+
+struct pool_job {
+    uv_work_t *req;
+    pool_work_cb work;
+    pool_after_cb after;
+    pool_job *next;
+};
+
+struct pool_thread {
+    uv_thread_t thread;
+    int slot;
+    bool started;
+    bool exited; // returned from worker(), still has to be joined
+};
+
+static uv_mutex_t lock;
+static uv_cond_t has_work;
+
+static pool_job *queue_head, *queue_tail;
+static pool_job *done_head, *done_tail;
+static int queued, running;
+
+static pool_thread threads[MAX_THREADS];
+static int live_threads;
+static int target_threads;
+static int max_queue;     // 0 means unbounded
+static bool pin_threads;
+static bool started;      // threads are started with the first request
+
+static uv_async_t done_async;
+static int outstanding;   // requests whose after callback hasn't run, main thread only
+
+static int
+cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static void
+pin_to_cpu(int slot)
+{
+    int cpu = slot % cpu_count();
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#else
+    (void)cpu; // not supported, threads float
+#endif
+}
+
+static void
+worker(void *arg)
+{
+    pool_thread *self = (pool_thread *)arg;
+
+    uv_mutex_lock(&lock);
+    if (pin_threads)
+        pin_to_cpu(self->slot);
+
+    for (;;) {
+        while (!queue_head && live_threads <= target_threads)
+            uv_cond_wait(&has_work, &lock);
+
+        if (live_threads > target_threads) {
+            live_threads--;
+            self->exited = true;
+            break;
+        }
+
+        pool_job *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        queued--;
+        running++;
+        uv_mutex_unlock(&lock);
+
+        job->work(job->req);
+
+        uv_mutex_lock(&lock);
+        running--;
+        if (job->after) {
+            job->next = NULL;
+            if (done_tail)
+                done_tail->next = job;
+            else
+                done_head = job;
+            done_tail = job;
+            uv_async_send(&done_async);
+        }
+        else {
+            free(job);
+        }
+    }
+    uv_mutex_unlock(&lock);
+}
+
+// Brings the number of threads up to target_threads. Called with lock held.
+static void
+start_threads()
+{
+    for (int i = 0; i < MAX_THREADS && live_threads < target_threads; i++) {
+        pool_thread *t = &threads[i];
+        if (t->started && t->exited) {
+            uv_mutex_unlock(&lock);
+            uv_thread_join(&t->thread);
+            uv_mutex_lock(&lock);
+            t->started = false;
+        }
+        if (t->started)
+            continue;
+
+        t->slot = i;
+        t->exited = false;
+        if (uv_thread_create(&t->thread, worker, t) == 0) {
+            t->started = true;
+            live_threads++;
+        }
+    }
+}
+
+#if UV_VERSION_MAJOR >= 1
+static void
+deliver_done(uv_async_t *handle)
+#else
+static void
+deliver_done(uv_async_t *handle, int status)
+#endif
+{
+    uv_mutex_lock(&lock);
+    pool_job *job = done_head;
+    done_head = done_tail = NULL;
+    uv_mutex_unlock(&lock);
+
+    while (job) {
+        pool_job *next = job->next;
+        job->after(job->req);
+        free(job);
+        if (--outstanding == 0)
+            uv_unref((uv_handle_t *)&done_async);
+        job = next;
+    }
+}
+
+void
+EncoderPool::Initialize(Handle<Object> target)
+{
+    NanScope();
+
+    uv_mutex_init(&lock);
+    uv_cond_init(&has_work);
+    target_threads = cpu_count();
+    if (target_threads > MAX_THREADS)
+        target_threads = MAX_THREADS;
+
+    uv_async_init(uv_default_loop(), &done_async, deliver_done);
+    uv_unref((uv_handle_t *)&done_async); // only keep the loop alive while busy
+
+    NODE_SET_METHOD(target, "configureThreadPool", Configure);
+    NODE_SET_METHOD(target, "threadPoolStats", Stats);
+}
+
+void
+EncoderPool::queue(uv_work_t *req, pool_work_cb work, pool_after_cb after)
+{
+    pool_job *job = (pool_job *)malloc(sizeof(*job));
+    if (!job) {
+        // run it in place rather than losing the callback
+        work(req);
+        if (after) after(req);
+        return;
+    }
+    job->req = req;
+    job->work = work;
+    job->after = after;
+    job->next = NULL;
+
+    if (after && outstanding++ == 0)
+        uv_ref((uv_handle_t *)&done_async);
+
+    uv_mutex_lock(&lock);
+    if (!started) {
+        started = true;
+        start_threads();
+    }
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    queued++;
+    uv_cond_signal(&has_work);
+    uv_mutex_unlock(&lock);
+}
+
+bool
+EncoderPool::full()
+{
+    uv_mutex_lock(&lock);
+    bool ret = max_queue > 0 && queued >= max_queue;
+    uv_mutex_unlock(&lock);
+    return ret;
+}
+
+int
+EncoderPool::size()
+{
+    uv_mutex_lock(&lock);
+    int ret = target_threads;
+    uv_mutex_unlock(&lock);
+    return ret;
+}
+
+// State of one parallel_for, shared by the caller and its helper jobs. A
+// helper that only gets to run after all iterations are taken just drops
+// its reference, so the caller never waits for helpers stuck in the queue.
+struct parallel_job {
+    void (*fn)(void *arg, int i);
+    void *arg;
+    int n, next, done;
+    int refs;
+    uv_mutex_t lock;
+    uv_cond_t finished;
+};
+
+// Runs iterations until none are left to take. Returns with p->lock held.
+static void
+run_iterations(parallel_job *p)
+{
+    uv_mutex_lock(&p->lock);
+    while (p->next < p->n) {
+        int i = p->next++;
+        uv_mutex_unlock(&p->lock);
+        p->fn(p->arg, i);
+        uv_mutex_lock(&p->lock);
+        if (++p->done == p->n)
+            uv_cond_signal(&p->finished);
+    }
+}
+
+// Drops a reference taken on p, called with p->lock held.
+static void
+unref_parallel_job(parallel_job *p)
+{
+    bool last = --p->refs == 0;
+    uv_mutex_unlock(&p->lock);
+    if (last) {
+        uv_cond_destroy(&p->finished);
+        uv_mutex_destroy(&p->lock);
+        free(p);
+    }
+}
+
+static void
+parallel_helper(uv_work_t *req)
+{
+    parallel_job *p = (parallel_job *)req->data;
+    free(req);
+    run_iterations(p);
+    unref_parallel_job(p);
+}
+
+void
+EncoderPool::parallel_for(int n, void (*fn)(void *arg, int i), void *arg)
+{
+    int helpers = size() - 1;
+    if (helpers > n - 1)
+        helpers = n - 1;
+
+    parallel_job *p = NULL;
+    if (helpers > 0)
+        p = (parallel_job *)malloc(sizeof(*p));
+    if (!p) {
+        for (int i = 0; i < n; i++)
+            fn(arg, i);
+        return;
+    }
+
+    p->fn = fn;
+    p->arg = arg;
+    p->n = n;
+    p->next = p->done = 0;
+    p->refs = 1 + helpers;
+    uv_mutex_init(&p->lock);
+    uv_cond_init(&p->finished);
+
+    for (int i = 0; i < helpers; i++) {
+        uv_work_t *req = (uv_work_t *)malloc(sizeof(*req));
+        if (!req) {
+            uv_mutex_lock(&p->lock);
+            p->refs--;
+            uv_mutex_unlock(&p->lock);
+            continue;
+        }
+        req->data = p;
+        queue(req, parallel_helper, NULL);
+    }
+
+    run_iterations(p);
+    while (p->done < p->n)
+        uv_cond_wait(&p->finished, &p->lock);
+    unref_parallel_job(p);
+}
+
+NAN_METHOD(EncoderPool::Configure)
+{
+    NanScope();
+
+    if (args.Length() != 1 || !args[0]->IsObject()) {
+        return NanThrowError("One argument required - options object {threads, pin, maxQueue}.");
+    }
+
+    Local<Object> opts = args[0]->ToObject();
+    Local<Value> nthreads = opts->Get(NanNew<String>("threads"));
+    Local<Value> pin = opts->Get(NanNew<String>("pin"));
+    Local<Value> maxq = opts->Get(NanNew<String>("maxQueue"));
+
+    if (!nthreads->IsUndefined() &&
+        (!nthreads->IsInt32() || nthreads->Int32Value() < 1 || nthreads->Int32Value() > MAX_THREADS))
+    {
+        return NanThrowError("threads must be an integer from 1 to 64.");
+    }
+    if (!maxq->IsUndefined() && (!maxq->IsInt32() || maxq->Int32Value() < 0)) {
+        return NanThrowError("maxQueue must be a non-negative integer, 0 for unbounded.");
+    }
+
+    uv_mutex_lock(&lock);
+    if (!nthreads->IsUndefined())
+        target_threads = nthreads->Int32Value();
+    if (!pin->IsUndefined())
+        pin_threads = pin->BooleanValue(); // applies to threads started from now on
+    if (!maxq->IsUndefined())
+        max_queue = maxq->Int32Value();
+    if (started)
+        start_threads();
+    uv_cond_broadcast(&has_work); // lets surplus threads exit
+    uv_mutex_unlock(&lock);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(EncoderPool::Stats)
+{
+    NanScope();
+
+    uv_mutex_lock(&lock);
+    int nthreads = started ? live_threads : target_threads;
+    int nqueued = queued, nrunning = running;
+    uv_mutex_unlock(&lock);
+
+    Local<Object> stats = NanNew<Object>();
+    stats->Set(NanNew<String>("threads"), NanNew<Number>(nthreads));
+    stats->Set(NanNew<String>("queued"), NanNew<Number>(nqueued));
+    stats->Set(NanNew<String>("running"), NanNew<Number>(nrunning));
+    NanReturnValue(stats);
+}
+
@@ -0,0 +1,38 @@
+#ifndef ENCODER_POOL_H
+#define ENCODER_POOL_H
+
+#include <nan.h>
+#include <node.h>
+
+typedef void (*pool_work_cb)(uv_work_t *req);
+typedef void (*pool_after_cb)(uv_work_t *req);
+
+/*
+ * Threads owned by the module that run the encodes, so a burst of them
+ * neither waits behind nor starves fs, dns and crypto work on libuv's
+ * threadpool. Defaults to one thread per CPU and an unbounded queue.
+ */
+class EncoderPool {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    // Runs work(req) on a pool thread, then after(req) on the main thread.
+    // `after` may be NULL for work that reports back by itself, only such
+    // work may be queued from pool threads.
+    static void queue(uv_work_t *req, pool_work_cb work, pool_after_cb after);
+
+    // Calls fn(arg, i) for every i in [0, n) on the calling thread and on
+    // whichever pool threads are idle, returning once all calls are done.
+    // fn must not throw. May be called from pool threads.
+    static void parallel_for(int n, void (*fn)(void *arg, int i), void *arg);
+
+    // true if the bounded queue can't take another request
+    static bool full();
+    static int size();
+
+    static NAN_METHOD(Configure);
+    static NAN_METHOD(Stats);
+};
+
+#endif
+
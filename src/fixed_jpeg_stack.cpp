@@ -8,6 +8,9 @@
 #include "common.h"
 #include "fixed_jpeg_stack.h"
 #include "jpeg_encoder.h"
+#include "encoder_pool.h"
+#include "blit.h"
+#include "frame_source.h"
 
 using v8::Object;
 using v8::Handle;
@@ -16,93 +19,105 @@ using v8::Function;
 using v8::FunctionTemplate;
 using v8::String;
 
+Persistent<FunctionTemplate> FixedJpegStack::constructor_template;
+
 void
 FixedJpegStack::Initialize(Handle<Object> target)
 {
     NanScope();
 
     Local<FunctionTemplate> t = NanNew<FunctionTemplate>(New);
+    NanAssignPersistent(constructor_template, t);
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", JpegEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(t, "pushBatch", PushBatch);
+    NODE_SET_PROTOTYPE_METHOD(t, "pushAsync", PushAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(t, "setOptions", SetOptions);
+    NODE_SET_PROTOTYPE_METHOD(t, "lastEncodeStats", LastEncodeStats);
     target->Set(NanNew<String>("FixedJpegStack"), t->GetFunction());
 }
 
 FixedJpegStack::FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type) :
-    width(wwidth), height(hheight), quality(60), buf_type(bbuf_type)
+    width(wwidth), height(hheight), quality(60), buf_type(bbuf_type),
+    jpeg_size_hint(0), changes(0)
 {
-    data = (unsigned char *)calloc(width*height*3, sizeof(*data));
+    unsigned char *data = (unsigned char *)calloc(width*height*3, sizeof(*data));
     if (!data) {
         throw "calloc in FixedJpegStack::FixedJpegStack failed!";
     }
+    frame.reset(data, width*height*3);
 }
 
 Handle<Value>
 FixedJpegStack::JpegEncodeSync()
 {
-    JpegEncoder jpeg_encoder(data, width, height, quality, BUF_RGB);
-    jpeg_encoder.encode();
-    Handle<Object> retbuf = NanNewBufferHandle((const char*) jpeg_encoder.get_jpeg(), jpeg_encoder.get_jpeg_len());
-    return retbuf;
+    fence.settle();
+    JpegEncoder jpeg_encoder(frame.pixels(), width, height, quality, BUF_RGB);
+    jpeg_encoder.set_options(options);
+    jpeg_encoder.set_size_hint(jpeg_size_hint);
+    bool incremental = row_cache.acquire();
+    if (incremental)
+        jpeg_encoder.set_row_cache(&row_cache);
+    try {
+        jpeg_encoder.encode();
+    }
+    catch (...) {
+        if (incremental)
+            row_cache.release(false);
+        throw;
+    }
+    if (incremental)
+        row_cache.release(true);
+    jpeg_size_hint = jpeg_encoder.get_size_hint();
+    last_stats = jpeg_encoder.get_stats();
+    int jpeg_len = jpeg_encoder.get_jpeg_len();
+    return adopt_jpeg_buffer((char *)jpeg_encoder.release_jpeg(), jpeg_len);
 }
 
 void
 FixedJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h)
 {
-    int start = y*width*3 + x*3;
-
-    switch (buf_type) {
-    case BUF_RGB:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGR:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf+=3;
-            }
-        }
-        break;
-
-    case BUF_RGBA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGRA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf += 4;
-            }
-        }
-        break;
+    fence.settle();
+    unsigned char *data = frame.writable();
+    row_cache.mark_dirty(y, h);
+    changes++;
+
+    blit_rgb(data + ((size_t)y*width + x)*3, (size_t)width*3,
+        data_buf, (size_t)w*bytes_per_pixel(buf_type), w, h, buf_type);
+}
+
+// Sets up the blit of a pushAsync. Only a frame an encode still reads is
+// copied here, after the pushes before are in it.
+void
+FixedJpegStack::PrepareAsyncPush(unsigned char *data_buf, int x, int y, int w,
+    int h, std::vector<blit_op> *ops)
+{
+    if (frame.shared())
+        fence.settle();
+    unsigned char *data = frame.writable();
+    row_cache.mark_dirty(y, h);
+    changes++;
+
+    blit_op op;
+    op.dst = data + ((size_t)y*width + x)*3;
+    op.dst_stride = (size_t)width*3;
+    op.src = data_buf;
+    op.src_stride = (size_t)w*bytes_per_pixel(buf_type);
+    op.w = w;
+    op.h = h;
+    ops->push_back(op);
+}
 
-    default:
-        throw "Unexpected buf_type in FixedJpegStack::Push";
+void
+FixedJpegStack::PushBatch(unsigned char *data_buf,
+    const std::vector<push_fragment> &fragments)
+{
+    for (size_t i = 0; i < fragments.size(); i++) {
+        const push_fragment &f = fragments[i];
+        Push(data_buf + f.offset, f.x, f.y, f.w, f.h);
     }
 }
 
@@ -111,6 +126,14 @@ void
 FixedJpegStack::SetQuality(int q)
 {
     quality = q;
+    changes++;
+}
+
+void
+FixedJpegStack::SetOptions(const encoder_options &opts)
+{
+    options = opts;
+    changes++;
 }
 
 NAN_METHOD(FixedJpegStack::New)
@@ -188,55 +211,192 @@ NAN_METHOD(FixedJpegStack::Push)
 {
     NanScope();
 
-    if (!node::Buffer::HasInstance(args[0])) {
-        NanThrowError("First argument must be Buffer.");
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
     }
     if (!args[1]->IsInt32()) {
-        NanThrowError("Second argument must be integer x.");
+        return NanThrowError("Second argument must be integer x.");
     }
     if (!args[2]->IsInt32()) {
-        NanThrowError("Third argument must be integer y.");
+        return NanThrowError("Third argument must be integer y.");
     }
     if (!args[3]->IsInt32()) {
-        NanThrowError("Fourth argument must be integer w.");
+        return NanThrowError("Fourth argument must be integer w.");
     }
     if (!args[4]->IsInt32()) {
-        NanThrowError("Fifth argument must be integer h.");
+        return NanThrowError("Fifth argument must be integer h.");
     }
 
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
-    Local<Object> data_buf = args[0]->ToObject();
     int x = args[1]->Int32Value();
     int y = args[2]->Int32Value();
     int w = args[3]->Int32Value();
     int h = args[4]->Int32Value();
 
     if (x < 0) {
-        NanThrowError("Coordinate x smaller than 0.");
+        return NanThrowError("Coordinate x smaller than 0.");
     }
     if (y < 0) {
-        NanThrowError("Coordinate y smaller than 0.");
+        return NanThrowError("Coordinate y smaller than 0.");
     }
     if (w < 0) {
-        NanThrowError("Width smaller than 0.");
+        return NanThrowError("Width smaller than 0.");
     }
     if (h < 0) {
-        NanThrowError("Height smaller than 0.");
+        return NanThrowError("Height smaller than 0.");
     }
     if (x >= jpeg->width) {
-        NanThrowError("Coordinate x exceeds FixedJpegStack's dimensions.");
+        return NanThrowError("Coordinate x exceeds FixedJpegStack's dimensions.");
     }
     if (y >= jpeg->height) {
-        NanThrowError("Coordinate y exceeds FixedJpegStack's dimensions.");
+        return NanThrowError("Coordinate y exceeds FixedJpegStack's dimensions.");
     }
     if (x+w > jpeg->width) {
-        NanThrowError("Pushed fragment exceeds FixedJpegStack's width.");
+        return NanThrowError("Pushed fragment exceeds FixedJpegStack's width.");
     }
     if (y+h > jpeg->height) {
-        NanThrowError("Pushed fragment exceeds FixedJpegStack's height.");
+        return NanThrowError("Pushed fragment exceeds FixedJpegStack's height.");
+    }
+
+    if ((size_t)w*h*bytes_per_pixel(jpeg->buf_type) > len) {
+        return NanThrowError("Buffer is smaller than the fragment.");
+    }
+
+    try {
+        jpeg->Push(data, x, y, w, h);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(FixedJpegStack::PushAsync)
+{
+    NanScope();
+
+    if (args.Length() < 5) {
+        return NanThrowError("At least five arguments required - buffer, x, y, width, height, [and callback].");
+    }
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
+    }
+    if (!args[1]->IsInt32()) {
+        return NanThrowError("Second argument must be integer x.");
+    }
+    if (!args[2]->IsInt32()) {
+        return NanThrowError("Third argument must be integer y.");
+    }
+    if (!args[3]->IsInt32()) {
+        return NanThrowError("Fourth argument must be integer w.");
+    }
+    if (!args[4]->IsInt32()) {
+        return NanThrowError("Fifth argument must be integer h.");
+    }
+    if (args.Length() > 5 && !args[5]->IsFunction()) {
+        return NanThrowError("Sixth argument must be a function.");
+    }
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    int x = args[1]->Int32Value();
+    int y = args[2]->Int32Value();
+    int w = args[3]->Int32Value();
+    int h = args[4]->Int32Value();
+
+    if (x < 0 || y < 0) {
+        return NanThrowError("Coordinates smaller than 0.");
+    }
+    if (w < 0 || h < 0) {
+        return NanThrowError("Width or height smaller than 0.");
+    }
+    if (x >= jpeg->width || y >= jpeg->height) {
+        return NanThrowError("Coordinates exceed FixedJpegStack's dimensions.");
+    }
+    if (w > jpeg->width - x || h > jpeg->height - y) {
+        return NanThrowError("Pushed fragment exceeds FixedJpegStack's dimensions.");
+    }
+    if ((size_t)w*h*bytes_per_pixel(jpeg->buf_type) > len) {
+        return NanThrowError("Buffer is smaller than the fragment.");
+    }
+
+    if (EncoderPool::full()) {
+        return NanThrowError("Encoder queue is full.");
+    }
+
+    push_request *push_req = new push_request;
+    try {
+        jpeg->PrepareAsyncPush(data, x, y, w, h, &push_req->ops);
+    }
+    catch (const char *err) {
+        delete push_req;
+        return NanThrowError(err);
+    }
+
+    push_req->callback = args.Length() > 5 ?
+        new NanCallback(args[5].As<Function>()) : NULL;
+    push_req->stack = jpeg;
+    NanAssignPersistent(push_req->buffer, args[0]->ToObject());
+    push_req->buf_type = jpeg->buf_type;
+    push_req->fence = &jpeg->fence;
+    jpeg->fence.issue(push_req);
+
+    uv_work_t* req = new uv_work_t;
+    req->data = push_req;
+    EncoderPool::queue(req, UV_PushAsync, UV_PushAsyncAfter);
+    jpeg->Ref();
+
+    NanReturnUndefined();
+}
+
+void
+FixedJpegStack::UV_PushAsync(uv_work_t *req)
+{
+    run_push((push_request *)req->data);
+}
+
+void
+FixedJpegStack::UV_PushAsyncAfter(uv_work_t *req)
+{
+    push_request *push_req = (push_request *)req->data;
+    delete req;
+    FixedJpegStack *jpeg = (FixedJpegStack *)push_req->stack;
+
+    finish_push(push_req);
+    jpeg->Unref();
+}
+
+NAN_METHOD(FixedJpegStack::PushBatch)
+{
+    NanScope();
+
+    if (args.Length() != 2) {
+        return NanThrowError("Two arguments required - buffer and fragments.");
+    }
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
     }
 
-    jpeg->Push((unsigned char *)node::Buffer::Data(data_buf), x, y, w, h);
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    std::vector<push_fragment> fragments;
+    const char *err = parse_push_batch(args[1], len,
+        bytes_per_pixel(jpeg->buf_type), jpeg->width, jpeg->height, &fragments);
+    if (err) {
+        return NanThrowError(err);
+    }
+
+    try {
+        jpeg->PushBatch(data, fragments);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
 
     NanReturnUndefined();
 }
@@ -268,28 +428,81 @@ NAN_METHOD(FixedJpegStack::SetQuality)
     NanReturnUndefined();
 }
 
-void
-FixedJpegStack::UV_JpegEncode(uv_work_t *req)
+NAN_METHOD(FixedJpegStack::SetOptions)
 {
-    encode_request *enc_req = (encode_request *)req->data;
-    FixedJpegStack *jpeg = (FixedJpegStack *)enc_req->jpeg_obj;
+    NanScope();
 
-    try {
-        JpegEncoder encoder(jpeg->data, jpeg->width, jpeg->height, jpeg->quality, BUF_RGB);
-        encoder.encode();
-        enc_req->jpeg_len = encoder.get_jpeg_len();
-        enc_req->jpeg = (char *)malloc(sizeof(*enc_req->jpeg)*enc_req->jpeg_len);
-        if (!enc_req->jpeg) {
-            enc_req->error = strdup("malloc in FixedJpegStack::UV_JpegEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->jpeg, encoder.get_jpeg(), enc_req->jpeg_len);
-        }
+    if (args.Length() != 1) {
+        return NanThrowError("One argument required - options object {subsampling, dct}");
     }
-    catch (const char *err) {
-        enc_req->error = strdup(err);
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    encoder_options opts = jpeg->options;
+    const char *err = parse_encoder_options(args[0], &opts);
+    if (err) {
+        return NanThrowError(err);
     }
+    jpeg->SetOptions(opts);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(FixedJpegStack::LastEncodeStats)
+{
+    NanScope();
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    NanReturnValue(encode_stats_object(jpeg->last_stats));
+}
+
+unsigned long
+FixedJpegStack::generation() const
+{
+    return changes;
+}
+
+encode_request *
+FixedJpegStack::begin_encode()
+{
+    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
+    if (!enc_req)
+        throw "malloc in FixedJpegStack::JpegEncodeAsync failed.";
+
+    enc_req->callback = NULL;
+    enc_req->jpeg_obj = this;
+    enc_req->frame = frame.freeze();
+    enc_req->rows = NULL;
+    enc_req->fence = &fence;
+    enc_req->pushes = fence.last();
+    enc_req->encoder = new JpegEncoder(enc_req->frame, width, height, quality, BUF_RGB);
+    enc_req->encoder->set_options(options);
+    enc_req->encoder->set_size_hint(jpeg_size_hint);
+    enc_req->incremental = row_cache.acquire();
+    enc_req->max_bytes = 0;
+    if (enc_req->incremental)
+        enc_req->encoder->set_row_cache(&row_cache);
+    enc_req->jpeg = NULL;
+    enc_req->jpeg_len = 0;
+    enc_req->error = NULL;
+    return enc_req;
+}
+
+void
+FixedJpegStack::end_encode(encode_request *enc_req)
+{
+    jpeg_size_hint = enc_req->encoder->get_size_hint();
+    last_stats = enc_req->encoder->get_stats();
+    frame.thaw(enc_req->frame);
+    if (enc_req->incremental)
+        row_cache.release(!enc_req->error);
+    delete enc_req->encoder;
+    enc_req->encoder = NULL;
+}
+
+void
+FixedJpegStack::UV_JpegEncode(uv_work_t *req)
+{
+    run_encode((encode_request *)req->data);
 }
 
 void 
@@ -299,26 +512,31 @@ FixedJpegStack::UV_JpegEncodeAfter(uv_work_t *req)
 
     encode_request *enc_req = (encode_request *)req->data;
     delete req;
+    FixedJpegStack *jpeg = (FixedJpegStack *)enc_req->jpeg_obj;
+    jpeg->end_encode(enc_req);
 
-    Handle<Value> argv[2];
+    Handle<Value> argv[3];
 
     if (enc_req->error) {
         argv[0] = NanUndefined();
         argv[1] = NanError(enc_req->error);
+        argv[2] = NanUndefined();
     }
     else {
-        Handle<Object> buf = NanNewBufferHandle(enc_req->jpeg, enc_req->jpeg_len);
+        Handle<Object> buf = adopt_jpeg_buffer(enc_req->jpeg, enc_req->jpeg_len);
+        enc_req->jpeg = NULL; // owned by buf now
         argv[0] = buf;
         argv[1] = NanUndefined();
+        argv[2] = encode_stats_object(jpeg->last_stats);
     }
 
-    enc_req->callback->Call(2, argv);
+    enc_req->callback->Call(3, argv);
 
     delete enc_req->callback;
-    free(enc_req->jpeg);
+    buffer_pool_release((unsigned char *)enc_req->jpeg);
     free(enc_req->error);
 
-    ((FixedJpegStack *)enc_req->jpeg_obj)->Unref();
+    jpeg->Unref();
     free(enc_req);
 }
 
@@ -337,20 +555,22 @@ NAN_METHOD(FixedJpegStack::JpegEncodeAsync)
     Local<Function> callback = args[0].As<Function>();
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
 
-    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
-    if (!enc_req) {
-        NanThrowError("malloc in FixedJpegStack::JpegEncodeAsync failed.");
+    if (EncoderPool::full()) {
+        return NanThrowError("Encoder queue is full.");
     }
 
+    encode_request *enc_req;
+    try {
+        enc_req = jpeg->begin_encode();
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
     enc_req->callback = new NanCallback(callback);
-    enc_req->jpeg_obj = jpeg;
-    enc_req->jpeg = NULL;
-    enc_req->jpeg_len = 0;
-    enc_req->error = NULL;
 
     uv_work_t* req = new uv_work_t;
     req->data = enc_req;
-    uv_queue_work(uv_default_loop(), req, UV_JpegEncode, (uv_after_work_cb)UV_JpegEncodeAfter);
+    EncoderPool::queue(req, UV_JpegEncode, UV_JpegEncodeAfter);
     jpeg->Ref();
 
     NanReturnUndefined();
@@ -6,28 +6,55 @@
 
 #include "common.h"
 #include "jpeg_encoder.h"
+#include "frame_buffer.h"
+#include "async_push.h"
+#include "frame_source.h"
 
-class FixedJpegStack : public node::ObjectWrap {
+class FixedJpegStack : public node::ObjectWrap, public FrameSource {
     int width, height, quality;
     buffer_type buf_type;
+    unsigned long jpeg_size_hint; // predicted size of the next jpeg
+    encoder_options options;
+    encode_stats last_stats;
 
-    unsigned char *data;
+    FrameBuffer frame;
+    McuRowCache row_cache; // encoded MCU rows, only pushed to rows are redone
+    PushFence fence; // orders pushAsync with everything else
+    unsigned long changes; // pushes and encoding settings, see generation()
+
+    void PrepareAsyncPush(unsigned char *data_buf, int x, int y, int w, int h,
+        std::vector<blit_op> *ops);
 
     static void UV_JpegEncode(uv_work_t *req);
     static void UV_JpegEncodeAfter(uv_work_t *req);
+    static void UV_PushAsync(uv_work_t *req);
+    static void UV_PushAsyncAfter(uv_work_t *req);
 
 public:
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
     static void Initialize(v8::Handle<v8::Object> target);
     FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type);
     v8::Handle<v8::Value> JpegEncodeSync();
     void Push(unsigned char *data_buf, int x, int y, int w, int h);
+    void PushBatch(unsigned char *data_buf,
+        const std::vector<push_fragment> &fragments);
     void SetQuality(int q);
+    void SetOptions(const encoder_options &opts);
+
+    unsigned long generation() const;
+    encode_request *begin_encode();
+    void end_encode(encode_request *enc_req);
 
     static NAN_METHOD(New);
     static NAN_METHOD(JpegEncodeSync);
     static NAN_METHOD(JpegEncodeAsync);
     static NAN_METHOD(Push);
+    static NAN_METHOD(PushBatch);
+    static NAN_METHOD(PushAsync);
     static NAN_METHOD(SetQuality);
+    static NAN_METHOD(SetOptions);
+    static NAN_METHOD(LastEncodeStats);
 };
 
 #endif
@@ -0,0 +1,101 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "frame_buffer.h"
+
+FrameBuffer::FrameBuffer() :
+    front(NULL), size(0), front_readers(0), spare(NULL) {}
+
+FrameBuffer::~FrameBuffer()
+{
+    free(front);
+    free(spare);
+    for (size_t i = 0; i < frozen.size(); i++)
+        free(frozen[i].pixels);
+}
+
+void
+FrameBuffer::reset(unsigned char *pixels, size_t ssize)
+{
+    if (front_readers) {
+        frozen_frame f = { front, size, front_readers };
+        frozen.push_back(f);
+    }
+    else {
+        free(front);
+    }
+    free(spare);
+    spare = NULL;
+
+    front = pixels;
+    size = ssize;
+    front_readers = 0;
+}
+
+unsigned char *
+FrameBuffer::pixels() const
+{
+    return front;
+}
+
+// Returns the current frame for modification, first copying it if an encode
+// is still reading it.
+unsigned char *
+FrameBuffer::writable()
+{
+    if (!front_readers)
+        return front;
+
+    unsigned char *copy = spare;
+    if (!copy) {
+        copy = (unsigned char *)malloc(size);
+        if (!copy) throw "malloc failed in FrameBuffer::writable.";
+    }
+    spare = NULL;
+    memcpy(copy, front, size);
+
+    frozen_frame f = { front, size, front_readers };
+    frozen.push_back(f);
+
+    front = copy;
+    front_readers = 0;
+    return front;
+}
+
+// true if writable() would copy the frame.
+bool
+FrameBuffer::shared() const
+{
+    return front_readers > 0;
+}
+
+// Marks the current frame as read by an async encode until thaw().
+unsigned char *
+FrameBuffer::freeze()
+{
+    front_readers++;
+    return front;
+}
+
+void
+FrameBuffer::thaw(unsigned char *frame)
+{
+    if (frame == front) {
+        front_readers--;
+        return;
+    }
+
+    for (size_t i = 0; i < frozen.size(); i++) {
+        if (frozen[i].pixels != frame)
+            continue;
+        if (--frozen[i].readers == 0) {
+            if (!spare && frozen[i].size == size)
+                spare = frame;
+            else
+                free(frame);
+            frozen.erase(frozen.begin() + i);
+        }
+        return;
+    }
+}
+
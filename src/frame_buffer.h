@@ -0,0 +1,43 @@
+#ifndef FRAME_BUFFER_H
+#define FRAME_BUFFER_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * RGB canvas of the jpeg stacks. An async encode freezes the current frame
+ * and reads it on the threadpool; the first push after that copies the frame
+ * and goes to the copy, so encodes always see a consistent frame and pushes
+ * never have to wait for them. All methods must be called on the main thread.
+ */
+class FrameBuffer {
+    struct frozen_frame {
+        unsigned char *pixels;
+        size_t size;
+        int readers;
+    };
+
+    unsigned char *front; // frame that pushes go to
+    size_t size;
+    int front_readers; // async encodes reading front
+
+    std::vector<frozen_frame> frozen; // older frames still being encoded
+    unsigned char *spare; // unused frame of `size` bytes, saves a malloc
+
+public:
+    FrameBuffer();
+    ~FrameBuffer();
+
+    // Takes ownership of malloc'd `pixels` as the new current frame.
+    void reset(unsigned char *pixels, size_t ssize);
+
+    unsigned char *pixels() const;
+    unsigned char *writable();
+    bool shared() const;
+
+    unsigned char *freeze();
+    void thaw(unsigned char *frame);
+};
+
+#endif
+
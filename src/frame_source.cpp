@@ -0,0 +1,28 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "frame_source.h"
+#include "jpeg_encoder.h"
+#include "async_push.h"
+
+// Finishes the async pushes made before the encode, then encodes, to fit
+// `max_bytes` if there is a budget.
+void
+run_encode(encode_request *enc_req)
+{
+    JpegEncoder *encoder = enc_req->encoder;
+    if (enc_req->fence)
+        enc_req->fence->run_until(enc_req->pushes);
+
+    try {
+        if (enc_req->max_bytes)
+            encoder->encode_to_size(enc_req->max_bytes);
+        else
+            encoder->encode();
+        enc_req->jpeg_len = encoder->get_jpeg_len();
+        enc_req->jpeg = (char *)encoder->release_jpeg();
+    }
+    catch (const char *err) {
+        enc_req->error = strdup(err);
+    }
+}
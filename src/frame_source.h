@@ -0,0 +1,29 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include "common.h"
+
+/*
+ * The async encode of a stack, split from its JS method so that MjpegStream
+ * can drive it too. begin_encode() and end_encode() run on the main thread,
+ * run_encode() in between on the EncoderPool.
+ */
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    // changes with every push or anything else that changes the next jpeg
+    virtual unsigned long generation() const = 0;
+
+    // Sets up an encode of the canvas as it is now, without a callback.
+    // Throws on failure.
+    virtual encode_request *begin_encode() = 0;
+
+    // Hands back what the encode borrowed from the stack and deletes its
+    // encoder; the jpeg and error are left to the caller.
+    virtual void end_encode(encode_request *enc_req) = 0;
+};
+
+void run_encode(encode_request *enc_req);
+
+#endif
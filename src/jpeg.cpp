@@ -8,6 +8,9 @@
 #include "common.h"
 #include "jpeg.h"
 #include "jpeg_encoder.h"
+#include "jpeg_cropper.h"
+#include "encoder_pool.h"
+#include "frame_source.h"
 
 using namespace v8;
 using namespace node;
@@ -26,37 +29,92 @@ Jpeg::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", JpegEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
     NODE_SET_PROTOTYPE_METHOD(t, "setSmoothing", SetSmoothing);
-    target->Set(NanNew<String>("Jpeg"), t->GetFunction());
+    NODE_SET_PROTOTYPE_METHOD(t, "setParallel", SetParallel);
+    NODE_SET_PROTOTYPE_METHOD(t, "setOptions", SetOptions);
+    NODE_SET_PROTOTYPE_METHOD(t, "lastEncodeStats", LastEncodeStats);
+
+    Local<Function> jpeg = t->GetFunction();
+    NODE_SET_METHOD(jpeg, "encodeBatch", JpegEncodeBatch);
+    NODE_SET_METHOD(jpeg, "crop", JpegCrop);
+    target->Set(NanNew<String>("Jpeg"), jpeg);
 }
 
 Jpeg::Jpeg(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type) :
-    jpeg_encoder(ddata, wwidth, hheight, 60, bbuf_type) {}
+    data(ddata), width(wwidth), height(hheight), quality(60), smoothing(0),
+    buf_type(bbuf_type), parallel(false), jpeg_size_hint(0) {}
 
+Jpeg::~Jpeg()
+{
+    NanDisposePersistent(pixel_buffer);
+}
+
+// Every encode gets an encoder of its own, so async encodes of the same
+// Jpeg can run at once.
+JpegEncoder *
+Jpeg::NewEncoder() const
+{
+    JpegEncoder *encoder = new JpegEncoder(data, width, height, quality, buf_type);
+    encoder->set_smoothing(smoothing);
+    encoder->set_parallel(parallel);
+    encoder->set_options(options);
+    encoder->set_cacheable(true);
+    encoder->set_size_hint(jpeg_size_hint);
+    return encoder;
+}
+
+void
+Jpeg::EndEncode(JpegEncoder *encoder)
+{
+    jpeg_size_hint = encoder->get_size_hint();
+    last_stats = encoder->get_stats();
+}
+
+// A byte budget searches for the quality, up to the one set, that fits it.
 Handle<Value>
-Jpeg::JpegEncodeSync()
+Jpeg::JpegEncodeSync(unsigned long max_bytes)
 {
+    JpegEncoder *encoder = NewEncoder();
     try {
-        jpeg_encoder.encode();
+        if (max_bytes)
+            encoder->encode_to_size(max_bytes);
+        else
+            encoder->encode();
     }
     catch (const char *err) {
+        delete encoder;
         NanThrowError(err);
+        return NanUndefined();
     }
+    EndEncode(encoder);
 
-    Handle<Object> retbuf = NanNewBufferHandle((const char *) jpeg_encoder.get_jpeg(), jpeg_encoder.get_jpeg_len());
-    // memcpy(Buffer::Data(retbuf), , jpeg_len);
-    return retbuf;
+    int jpeg_len = encoder->get_jpeg_len();
+    Handle<Value> buf = adopt_jpeg_buffer((char *)encoder->release_jpeg(), jpeg_len);
+    delete encoder;
+    return buf;
 }
 
 void
 Jpeg::SetQuality(int q)
 {
-    jpeg_encoder.set_quality(q);
+    quality = q;
 }
 
 void
 Jpeg::SetSmoothing(int s)
 {
-    jpeg_encoder.set_smoothing(s);
+    smoothing = s;
+}
+
+void
+Jpeg::SetParallel(bool p)
+{
+    parallel = p;
+}
+
+void
+Jpeg::SetOptions(const encoder_options &opts)
+{
+    options = opts;
 }
 
 NAN_METHOD(Jpeg::New)
@@ -64,39 +122,41 @@ NAN_METHOD(Jpeg::New)
     NanScope();
 
     if (args.Length() < 3) {
-        NanThrowError("At least three arguments required - buffer, width, height, [and buffer type]");
+        return NanThrowError("At least three arguments required - buffer, width, height, [and buffer type]");
     }
-    if (!Buffer::HasInstance(args[0])) {
-        NanThrowError("First argument must be Buffer.");
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
     }
     if (!args[1]->IsInt32()) {
-        NanThrowError("Second argument must be integer width.");
+        return NanThrowError("Second argument must be integer width.");
     }
     if (!args[2]->IsInt32()) {
-        NanThrowError("Third argument must be integer height.");
+        return NanThrowError("Third argument must be integer height.");
     }
 
     int w = args[1]->Int32Value();
     int h = args[2]->Int32Value();
 
     if (w < 0) {
-        NanThrowError("Width can't be negative.");
+        return NanThrowError("Width can't be negative.");
     }
     if (h < 0) {
-        NanThrowError("Height can't be negative.");
+        return NanThrowError("Height can't be negative.");
     }
 
     buffer_type buf_type = BUF_RGB;
     if (args.Length() == 4) {
         if (!args[3]->IsString()) {
-            NanThrowError("Fifth argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowError("Fifth argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
         }
 
         NanUtf8String bt(args[3]->ToString());
         if (!(str_eq(*bt, "rgb") || str_eq(*bt, "bgr") ||
             str_eq(*bt, "rgba") || str_eq(*bt, "bgra")))
         {
-            NanThrowError("Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowError("Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
         }
 
         if (str_eq(*bt, "rgb")) {
@@ -108,22 +168,51 @@ NAN_METHOD(Jpeg::New)
         } else if (str_eq(*bt, "bgra")) {
             buf_type = BUF_BGRA;
         } else {
-            NanThrowError("Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowError("Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
         }
     }
 
-    Local<Object> buffer = args[0]->ToObject();
-    Jpeg *jpeg = new Jpeg((unsigned char*) Buffer::Data(buffer), w, h, buf_type);
+    if (len < (size_t)w*h*bytes_per_pixel(buf_type)) {
+        return NanThrowError("Buffer is smaller than width*height pixels.");
+    }
+
+    Jpeg *jpeg = new Jpeg(data, w, h, buf_type);
+    NanAssignPersistent(jpeg->pixel_buffer, args[0]->ToObject());
     jpeg->Wrap(args.This());
     NanReturnThis();
 }
 
+// Reads the options of encode() and encodeSync(): {maxBytes}.
+static const char *
+parse_encode_options(Handle<Value> val, unsigned long *max_bytes)
+{
+    if (!val->IsObject())
+        return "Options must be an object {maxBytes}.";
+
+    Local<Value> maxb = val->ToObject()->Get(NanNew<String>("maxBytes"));
+    *max_bytes = 0;
+    if (!maxb->IsUndefined()) {
+        if (!maxb->IsNumber() || maxb->NumberValue() < 1 || maxb->NumberValue() > 4294967295.0)
+            return "maxBytes must be a positive number of bytes.";
+        *max_bytes = (unsigned long)maxb->NumberValue();
+    }
+    return NULL;
+}
+
 NAN_METHOD(Jpeg::JpegEncodeSync)
 {
     NanScope();
 
+    unsigned long max_bytes = 0;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], &max_bytes);
+        if (err) {
+            return NanThrowError(err);
+        }
+    }
+
     Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
-    NanReturnValue(jpeg->JpegEncodeSync());
+    NanReturnValue(jpeg->JpegEncodeSync(max_bytes));
 }
 
 NAN_METHOD(Jpeg::SetQuality)
@@ -180,27 +269,55 @@ NAN_METHOD(Jpeg::SetSmoothing)
     NanReturnUndefined();
 }
 
-void
-Jpeg::UV_JpegEncode(uv_work_t *req)
+NAN_METHOD(Jpeg::SetParallel)
 {
-    encode_request *enc_req = (encode_request *)req->data;
-    Jpeg *jpeg = (Jpeg *)enc_req->jpeg_obj;
+    NanScope();
 
-    try {
-        jpeg->jpeg_encoder.encode();
-        enc_req->jpeg_len = jpeg->jpeg_encoder.get_jpeg_len();
-        enc_req->jpeg = (char *)malloc(sizeof(*enc_req->jpeg)*enc_req->jpeg_len);
-        if (!enc_req->jpeg) {
-            enc_req->error = strdup("malloc in Jpeg::UV_JpegEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->jpeg, jpeg->jpeg_encoder.get_jpeg(), enc_req->jpeg_len);
-        }
+    if (args.Length() != 1) {
+        return NanThrowError("One argument required - parallel");
     }
-    catch (const char *err) {
-        enc_req->error = strdup(err);
+
+    if (!args[0]->IsBoolean()) {
+        return NanThrowError("First argument must be boolean parallel");
     }
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    jpeg->SetParallel(args[0]->BooleanValue());
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Jpeg::SetOptions)
+{
+    NanScope();
+
+    if (args.Length() != 1) {
+        return NanThrowError("One argument required - options object {subsampling, dct}");
+    }
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    encoder_options opts = jpeg->options;
+    const char *err = parse_encoder_options(args[0], &opts);
+    if (err) {
+        return NanThrowError(err);
+    }
+    jpeg->SetOptions(opts);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Jpeg::LastEncodeStats)
+{
+    NanScope();
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    NanReturnValue(encode_stats_object(jpeg->last_stats));
+}
+
+void
+Jpeg::UV_JpegEncode(uv_work_t *req)
+{
+    run_encode((encode_request *)req->data);
 }
 
 void 
@@ -211,30 +328,36 @@ Jpeg::UV_JpegEncodeAfter(uv_work_t *req)
     encode_request *enc_req = (encode_request *)req->data;
     delete req;
 
-    Handle<Value> argv[2];
+    Jpeg *jpeg = (Jpeg *)enc_req->jpeg_obj;
+    jpeg->EndEncode(enc_req->encoder);
+    Handle<Value> argv[3];
 
     if (enc_req->error) {
         argv[0] = NanUndefined();
         argv[1] = NanError(enc_req->error);
+        argv[2] = NanUndefined();
     }
     else {
-        Handle<Object> buf = NanNewBufferHandle(enc_req->jpeg, enc_req->jpeg_len);
+        Handle<Object> buf = adopt_jpeg_buffer(enc_req->jpeg, enc_req->jpeg_len);
+        enc_req->jpeg = NULL; // owned by buf now
         argv[0] = buf;
         argv[1] = NanUndefined();
+        argv[2] = encode_stats_object(enc_req->encoder->get_stats());
     }
 
     TryCatch try_catch; // don't quite see the necessity of this
 
-    enc_req->callback->Call(2, argv);
+    enc_req->callback->Call(3, argv);
 
     if (try_catch.HasCaught())
         FatalException(try_catch);
 
     delete enc_req->callback;
-    free(enc_req->jpeg);
+    delete enc_req->encoder;
+    buffer_pool_release((unsigned char *)enc_req->jpeg);
     free(enc_req->error);
 
-    ((Jpeg *)enc_req->jpeg_obj)->Unref();
+    jpeg->Unref();
     free(enc_req);
 }
 
@@ -242,34 +365,288 @@ NAN_METHOD(Jpeg::JpegEncodeAsync)
 {
     NanScope();
 
-    if (args.Length() != 1) {
-        NanThrowError("One argument required - callback function.");
+    if (args.Length() < 1 || args.Length() > 2) {
+        return NanThrowError("One or two arguments required - [options and] callback function.");
+    }
+
+    unsigned long max_bytes = 0;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], &max_bytes);
+        if (err) {
+            return NanThrowError(err);
+        }
     }
 
-    if (!args[0]->IsFunction()) {
-        NanThrowError("First argument must be a function.");
+    if (!args[args.Length() - 1]->IsFunction()) {
+        return NanThrowError("Last argument must be a function.");
     }
 
-    Local<Function> callback = args[0].As<Function>();
+    Local<Function> callback = args[args.Length() - 1].As<Function>();
     Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
 
+    if (EncoderPool::full()) {
+        return NanThrowError("Encoder queue is full.");
+    }
+
     encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
     if (!enc_req) {
-        NanThrowError("malloc in Jpeg::JpegEncodeAsync failed.");
+        return NanThrowError("malloc in Jpeg::JpegEncodeAsync failed.");
     }
 
     enc_req->callback = new NanCallback(callback);
     enc_req->jpeg_obj = jpeg;
+    enc_req->encoder = jpeg->NewEncoder();
+    enc_req->frame = NULL;
+    enc_req->rows = NULL;
+    enc_req->fence = NULL;
+    enc_req->pushes = 0;
+    enc_req->incremental = false;
+    enc_req->max_bytes = max_bytes;
     enc_req->jpeg = NULL;
     enc_req->jpeg_len = 0;
     enc_req->error = NULL;
 
     uv_work_t* req = new uv_work_t;
     req->data = enc_req;
-    uv_queue_work(uv_default_loop(), req, UV_JpegEncode, (uv_after_work_cb)UV_JpegEncodeAfter);
+    EncoderPool::queue(req, UV_JpegEncode, UV_JpegEncodeAfter);
 
     jpeg->Ref();
 
     NanReturnUndefined();
 }
 
+/*
+ * Jpeg.encodeBatch([{buffer, width, height, type, quality}, ...], cb)
+ *
+ * All items are encoded behind a single call. One work request per pool
+ * thread shares the batch and keeps taking the next item until none are
+ * left, the callback
+ * gets an array with a Buffer or an Error for every item.
+ */
+
+struct batch_item {
+    Persistent<Object> buffer; // keeps `data` alive, empty if error is set
+    unsigned char *data;
+    int width, height, quality;
+    buffer_type buf_type;
+    char *jpeg;
+    int jpeg_len;
+    const char *error; // static string, or NULL
+};
+
+struct encode_batch {
+    NanCallback *callback;
+    batch_item *entries;
+    int count;
+
+    uv_mutex_t lock;
+    int next;    // next entry to encode
+    int workers; // work requests that haven't finished
+};
+
+// Fills in `item` from its JS description, returns an error message if
+// the description is unusable.
+static const char *
+parse_batch_item(Handle<Value> val, batch_item *item)
+{
+    if (!val->IsObject())
+        return "Batch item must be an object.";
+
+    Local<Object> obj = val->ToObject();
+    Local<Value> buffer = obj->Get(NanNew<String>("buffer"));
+    Local<Value> width = obj->Get(NanNew<String>("width"));
+    Local<Value> height = obj->Get(NanNew<String>("height"));
+    Local<Value> type = obj->Get(NanNew<String>("type"));
+    Local<Value> quality = obj->Get(NanNew<String>("quality"));
+
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(buffer, &data, &len))
+        return "Batch item's buffer must be Buffer, ArrayBuffer or typed array.";
+    if (!width->IsInt32() || width->Int32Value() < 0)
+        return "Batch item's width must be a non-negative integer.";
+    if (!height->IsInt32() || height->Int32Value() < 0)
+        return "Batch item's height must be a non-negative integer.";
+
+    item->buf_type = BUF_RGB;
+    if (!type->IsUndefined()) {
+        if (!type->IsString())
+            return "Batch item's type must be 'rgb', 'bgr', 'rgba' or 'bgra'.";
+        NanUtf8String bt(type->ToString());
+        if (!parse_buffer_type(*bt, &item->buf_type))
+            return "Batch item's type must be 'rgb', 'bgr', 'rgba' or 'bgra'.";
+    }
+
+    item->quality = 60;
+    if (!quality->IsUndefined()) {
+        if (!quality->IsInt32() || quality->Int32Value() < 0 || quality->Int32Value() > 100)
+            return "Batch item's quality must be an integer from 0 to 100.";
+        item->quality = quality->Int32Value();
+    }
+
+    item->width = width->Int32Value();
+    item->height = height->Int32Value();
+    if (len < (size_t)item->width*item->height*bytes_per_pixel(item->buf_type))
+        return "Batch item's buffer is smaller than width*height pixels.";
+
+    item->data = data;
+    NanAssignPersistent(item->buffer, buffer->ToObject());
+    return NULL;
+}
+
+void
+Jpeg::UV_JpegEncodeBatch(uv_work_t *req)
+{
+    encode_batch *batch = (encode_batch *)req->data;
+
+    for (;;) {
+        uv_mutex_lock(&batch->lock);
+        int i = batch->next++;
+        uv_mutex_unlock(&batch->lock);
+        if (i >= batch->count)
+            break;
+
+        batch_item *item = &batch->entries[i];
+        if (item->error)
+            continue;
+
+        try {
+            JpegEncoder encoder(item->data, item->width, item->height,
+                item->quality, item->buf_type);
+            encoder.set_cacheable(true);
+            encoder.encode();
+            item->jpeg_len = encoder.get_jpeg_len();
+            item->jpeg = (char *)encoder.release_jpeg();
+        }
+        catch (const char *err) {
+            item->error = err;
+        }
+    }
+}
+
+void
+Jpeg::UV_JpegEncodeBatchAfter(uv_work_t *req)
+{
+    NanScope();
+
+    encode_batch *batch = (encode_batch *)req->data;
+    delete req;
+
+    if (--batch->workers > 0)
+        return;
+
+    Local<Array> results = NanNew<Array>(batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        batch_item *item = &batch->entries[i];
+        if (item->error) {
+            results->Set(i, NanError(item->error));
+        }
+        else {
+            results->Set(i, adopt_jpeg_buffer(item->jpeg, item->jpeg_len));
+            item->jpeg = NULL; // owned by the Buffer now
+        }
+    }
+
+    Handle<Value> argv[2];
+    argv[0] = results;
+    argv[1] = NanUndefined();
+
+    TryCatch try_catch;
+
+    batch->callback->Call(2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    delete batch->callback;
+    for (int i = 0; i < batch->count; i++)
+        NanDisposePersistent(batch->entries[i].buffer);
+    uv_mutex_destroy(&batch->lock);
+    delete[] batch->entries;
+    delete batch;
+}
+
+NAN_METHOD(Jpeg::JpegEncodeBatch)
+{
+    NanScope();
+
+    if (args.Length() != 2) {
+        return NanThrowError("Two arguments required - array of items and callback function.");
+    }
+    if (!args[0]->IsArray()) {
+        return NanThrowError("First argument must be an array.");
+    }
+    if (!args[1]->IsFunction()) {
+        return NanThrowError("Second argument must be a function.");
+    }
+
+    if (EncoderPool::full()) {
+        return NanThrowError("Encoder queue is full.");
+    }
+
+    Local<Array> items = args[0].As<Array>();
+    Local<Function> callback = args[1].As<Function>();
+    int count = items->Length();
+
+    // each item holds on to its own buffer, JS may change the items meanwhile
+    batch_item *entries = new batch_item[count ? count : 1]();
+    for (int i = 0; i < count; i++) {
+        entries[i].error = parse_batch_item(items->Get(i), &entries[i]);
+    }
+
+    encode_batch *batch = new encode_batch;
+    batch->callback = new NanCallback(callback);
+    batch->entries = entries;
+    batch->count = count;
+    batch->next = 0;
+    batch->workers = count < EncoderPool::size() ? (count ? count : 1) : EncoderPool::size();
+    uv_mutex_init(&batch->lock);
+
+    for (int i = 0, n = batch->workers; i < n; i++) {
+        uv_work_t* req = new uv_work_t;
+        req->data = batch;
+        EncoderPool::queue(req, UV_JpegEncodeBatch, UV_JpegEncodeBatchAfter);
+    }
+
+    NanReturnUndefined();
+}
+
+/*
+ * Jpeg.crop(jpeg, x, y, w, h)
+ *
+ * Cuts a rectangle out of an encoded jpeg without decoding it. x and y are
+ * rounded down to the MCU grid (8 or 16 pixels) and w, h are grown to keep
+ * the right and bottom edges where they were asked for.
+ */
+NAN_METHOD(Jpeg::JpegCrop)
+{
+    NanScope();
+
+    if (args.Length() != 5) {
+        return NanThrowError("Five arguments required - jpeg buffer, x, y, width, height.");
+    }
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
+    }
+    for (int i = 1; i < 5; i++) {
+        if (!args[i]->IsInt32()) {
+            return NanThrowError("Crop x, y, width and height must be integers.");
+        }
+    }
+
+    Rect rect(args[1]->Int32Value(), args[2]->Int32Value(),
+        args[3]->Int32Value(), args[4]->Int32Value());
+    JpegCropper cropper(data, len, rect);
+
+    try {
+        cropper.crop();
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    int jpeg_len = cropper.get_jpeg_len();
+    NanReturnValue(adopt_jpeg_buffer((char *)cropper.release_jpeg(), jpeg_len));
+}
@@ -14,22 +14,42 @@ using v8::String;
 using v8::Value;
 
 class Jpeg : public node::ObjectWrap {
-    JpegEncoder jpeg_encoder;
+    unsigned char *data;
+    int width, height, quality, smoothing;
+    buffer_type buf_type;
+    bool parallel;
+    encoder_options options;
+    unsigned long jpeg_size_hint;
+    encode_stats last_stats;
+    v8::Persistent<v8::Object> pixel_buffer; // keeps the pixels alive
+
+    JpegEncoder *NewEncoder() const;
+    void EndEncode(JpegEncoder *encoder);
 
     static void UV_JpegEncode(uv_work_t *req);
     static void UV_JpegEncodeAfter(uv_work_t *req);
+    static void UV_JpegEncodeBatch(uv_work_t *req);
+    static void UV_JpegEncodeBatchAfter(uv_work_t *req);
 public:
     static void Initialize(Handle<Object> target);
     Jpeg(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type);
-    Handle<Value> JpegEncodeSync();
+    ~Jpeg();
+    Handle<Value> JpegEncodeSync(unsigned long max_bytes);
     void SetQuality(int q);
     void SetSmoothing(int s);
+    void SetParallel(bool p);
+    void SetOptions(const encoder_options &opts);
 
     static NAN_METHOD(New);
     static NAN_METHOD(JpegEncodeSync);
     static NAN_METHOD(JpegEncodeAsync);
+    static NAN_METHOD(JpegEncodeBatch);
+    static NAN_METHOD(JpegCrop);
     static NAN_METHOD(SetQuality);
     static NAN_METHOD(SetSmoothing);
+    static NAN_METHOD(SetParallel);
+    static NAN_METHOD(SetOptions);
+    static NAN_METHOD(LastEncodeStats);
 };
 
 #endif
@@ -0,0 +1,160 @@
+#include "jpeg_cropper.h"
+#include "jpeg_decompressor.h"
+#include "jpeg_encoder.h"
+
+JpegCropper::JpegCropper(const unsigned char *jjpeg, unsigned long jjpeg_len,
+    const Rect &r)
+    :
+      jpeg(jjpeg), jpeg_len(jjpeg_len), rect(r),
+      cropped(NULL), cropped_len(0)
+{
+    error_message[0] = '\0';
+}
+
+JpegCropper::~JpegCropper() {
+    buffer_pool_release(cropped);
+}
+
+// Fails the crop the same way libjpeg errors do.
+static void
+crop_error(jump_error_mgr *err, const char *message)
+{
+    strncpy(err->message, message, JMSG_LENGTH_MAX - 1);
+    err->message[JMSG_LENGTH_MAX - 1] = '\0';
+    longjmp(err->setjmp_buffer, 1);
+}
+
+// Throws libjpeg's message for broken jpegs, which lives in this object, so
+// it must be caught before the object goes away.
+void
+JpegCropper::crop()
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    jump_error_mgr jerr;
+
+    // zeroed so that both can be destroyed whatever point an error came from
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    src.err = jump_error(&jerr, error_message);
+    dst.err = &jerr.pub;
+
+    if (setjmp(jerr.setjmp_buffer)) {
+        abort_pool_destination(&dst);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        throw (const char *)error_message;
+    }
+
+    buffer_pool_release(cropped);
+    cropped = NULL;
+    cropped_len = 0;
+
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    jpeg_buffer_src(&src, jpeg, jpeg_len);
+    jpeg_read_header(&src, TRUE);
+
+    int image_width = src.image_width, image_height = src.image_height;
+    if (rect.x < 0 || rect.y < 0 || rect.w <= 0 || rect.h <= 0 ||
+        rect.x >= image_width || rect.y >= image_height)
+    {
+        crop_error(&jerr, "Crop rectangle is outside the jpeg.");
+    }
+
+    jvirt_barray_ptr *src_coefs = jpeg_read_coefficients(&src);
+
+#if JPEG_LIB_VERSION >= 70
+    int mcu_w = src.max_h_samp_factor*src.min_DCT_h_scaled_size;
+    int mcu_h = src.max_v_samp_factor*src.min_DCT_v_scaled_size;
+#else
+    int mcu_w = src.max_h_samp_factor*DCTSIZE;
+    int mcu_h = src.max_v_samp_factor*DCTSIZE;
+#endif
+
+    // the top left corner moves to the MCU grid, the bottom right one stays
+    // where it was asked for as partial MCUs are fine at those edges
+    int x0 = rect.x/mcu_w*mcu_w, y0 = rect.y/mcu_h*mcu_h;
+    int x1 = rect.x + rect.w, y1 = rect.y + rect.h;
+    if (x1 > image_width) x1 = image_width;
+    if (y1 > image_height) y1 = image_height;
+    rect = Rect(x0, y0, x1 - x0, y1 - y0);
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.image_width = rect.w;
+    dst.image_height = rect.h;
+
+    JDIMENSION width_in_mcus = (rect.w + mcu_w - 1)/mcu_w;
+    JDIMENSION height_in_mcus = (rect.h + mcu_h - 1)/mcu_h;
+    jvirt_barray_ptr *dst_coefs = (jvirt_barray_ptr *)
+        (*dst.mem->alloc_small)((j_common_ptr)&dst, JPOOL_IMAGE,
+                                sizeof(jvirt_barray_ptr)*dst.num_components);
+    for (int ci = 0; ci < dst.num_components; ci++) {
+        jpeg_component_info *comp = &dst.comp_info[ci];
+        dst_coefs[ci] = (*dst.mem->request_virt_barray)((j_common_ptr)&dst,
+            JPOOL_IMAGE, TRUE, width_in_mcus*comp->h_samp_factor,
+            height_in_mcus*comp->v_samp_factor, comp->v_samp_factor);
+    }
+
+    // the coefficients take about as much space per pixel as the source
+    size_t expected_size = 1024 + (size_t)((double)jpeg_len*rect.w*rect.h/
+        ((double)image_width*image_height));
+
+    try {
+        jpeg_pool_dest(&dst, &cropped, &cropped_len, expected_size);
+        jpeg_write_coefficients(&dst, dst_coefs);
+
+        for (int ci = 0; ci < dst.num_components; ci++) {
+            jpeg_component_info *comp = &dst.comp_info[ci];
+            JDIMENSION x_blocks = x0/mcu_w*comp->h_samp_factor;
+            JDIMENSION y_blocks = y0/mcu_h*comp->v_samp_factor;
+
+            for (JDIMENSION y = 0; y < comp->height_in_blocks; y += comp->v_samp_factor) {
+                JBLOCKARRAY dst_rows = (*dst.mem->access_virt_barray)((j_common_ptr)&dst,
+                    dst_coefs[ci], y, comp->v_samp_factor, TRUE);
+                JBLOCKARRAY src_rows = (*src.mem->access_virt_barray)((j_common_ptr)&src,
+                    src_coefs[ci], y + y_blocks, comp->v_samp_factor, FALSE);
+                for (int r = 0; r < comp->v_samp_factor; r++) {
+                    memcpy(dst_rows[r], src_rows[r] + x_blocks,
+                        comp->width_in_blocks*sizeof(JBLOCK));
+                }
+            }
+        }
+
+        jpeg_finish_compress(&dst);
+    }
+    catch (...) {
+        abort_pool_destination(&dst);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        throw;
+    }
+
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+}
+
+// Gives up ownership of the cropped jpeg; the caller must hand it back with
+// buffer_pool_release().
+unsigned char *
+JpegCropper::release_jpeg()
+{
+    unsigned char *ret = cropped;
+    cropped = NULL;
+    cropped_len = 0;
+    return ret;
+}
+
+unsigned long
+JpegCropper::get_jpeg_len() const
+{
+    return cropped_len;
+}
+
+const Rect &
+JpegCropper::getRect() const
+{
+    return rect;
+}
+
@@ -0,0 +1,36 @@
+#ifndef JPEG_CROPPER_H
+#define JPEG_CROPPER_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <jpeglib.h>
+#include "common.h"
+#include "buffer_pool.h"
+
+/*
+ * Crops a jpeg by copying its DCT coefficients, like jpegtran -crop. There
+ * is no decoding and no requantization, so the cropped part is exactly what
+ * it was in the source. The left and top edges move to the MCU grid.
+ */
+class JpegCropper {
+    const unsigned char *jpeg;
+    unsigned long jpeg_len;
+    Rect rect; // the requested rect, after crop() the one actually cropped
+
+    unsigned char *cropped; // from buffer_pool.cpp
+    unsigned long cropped_len;
+
+    char error_message[JMSG_LENGTH_MAX]; // what libjpeg errors throw
+
+public:
+    JpegCropper(const unsigned char *jjpeg, unsigned long jjpeg_len, const Rect &r);
+    ~JpegCropper();
+
+    void crop();
+    unsigned char *release_jpeg();
+    unsigned long get_jpeg_len() const;
+    const Rect &getRect() const;
+};
+
+#endif
+
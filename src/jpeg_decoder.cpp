@@ -0,0 +1,258 @@
+#include <nan.h>
+#include <node.h>
+#include <node_buffer.h>
+#include <jpeglib.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "common.h"
+#include "jpeg_decoder.h"
+#include "jpeg_decompressor.h"
+#include "encoder_pool.h"
+
+using namespace v8;
+using namespace node;
+
+struct decode_request {
+    NanCallback *callback;
+    JpegDecoder *decoder_obj;
+    JpegDecompressor *decompressor;
+    char *error;
+};
+
+void
+JpegDecoder::Initialize(Handle<Object> target)
+{
+    NanScope();
+
+    Local<FunctionTemplate> t = NanNew<FunctionTemplate>(New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "decode", JpegDecodeAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "decodeSync", JpegDecodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "dimensions", Dimensions);
+    NODE_SET_PROTOTYPE_METHOD(t, "setScale", SetScale);
+    target->Set(NanNew<String>("JpegDecoder"), t->GetFunction());
+}
+
+JpegDecoder::JpegDecoder(const unsigned char *jjpeg, unsigned long jjpeg_len,
+    buffer_type bbuf_type) :
+    jpeg(jjpeg), jpeg_len(jjpeg_len), buf_type(bbuf_type), scale_denom(1) {}
+
+JpegDecoder::~JpegDecoder()
+{
+    NanDisposePersistent(jpeg_buffer);
+}
+
+Handle<Value>
+JpegDecoder::Dimensions(int width, int height)
+{
+    Local<Object> dim = NanNew<Object>();
+    dim->Set(NanNew<String>("width"), NanNew<Number>(width));
+    dim->Set(NanNew<String>("height"), NanNew<Number>(height));
+    return dim;
+}
+
+Handle<Value>
+JpegDecoder::JpegDecodeSync()
+{
+    JpegDecompressor decompressor(jpeg, jpeg_len, buf_type);
+    decompressor.set_scale(scale_denom);
+    try {
+        decompressor.decode();
+    }
+    catch (const char *err) {
+        NanThrowError(err);
+        return NanUndefined();
+    }
+
+    int len = decompressor.get_width()*decompressor.get_height()*bytes_per_pixel(buf_type);
+    return adopt_jpeg_buffer((char *)decompressor.release_pixels(), len);
+}
+
+// Output size at the current scale, only the header is read for it.
+Handle<Value>
+JpegDecoder::Dimensions()
+{
+    JpegDecompressor decompressor(jpeg, jpeg_len, buf_type);
+    decompressor.set_scale(scale_denom);
+    try {
+        decompressor.read_dimensions();
+    }
+    catch (const char *err) {
+        NanThrowError(err);
+        return NanUndefined();
+    }
+    return Dimensions(decompressor.get_width(), decompressor.get_height());
+}
+
+void
+JpegDecoder::SetScale(int denom)
+{
+    scale_denom = denom;
+}
+
+NAN_METHOD(JpegDecoder::New)
+{
+    NanScope();
+
+    if (args.Length() < 1) {
+        return NanThrowError("At least one argument required - jpeg buffer, [and buffer type]");
+    }
+    unsigned char *data;
+    size_t len;
+    if (!input_bytes(args[0], &data, &len)) {
+        return NanThrowError("First argument must be Buffer, ArrayBuffer or typed array.");
+    }
+
+    buffer_type buf_type = BUF_RGB;
+    if (args.Length() >= 2) {
+        if (!args[1]->IsString()) {
+            return NanThrowError("Second argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
+        }
+
+        NanUtf8String bt(args[1]->ToString());
+        if (!parse_buffer_type(*bt, &buf_type)) {
+            return NanThrowError("Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+        }
+    }
+
+    JpegDecoder *decoder = new JpegDecoder(data, len, buf_type);
+    NanAssignPersistent(decoder->jpeg_buffer, args[0]->ToObject());
+    decoder->Wrap(args.This());
+    NanReturnThis();
+}
+
+NAN_METHOD(JpegDecoder::JpegDecodeSync)
+{
+    NanScope();
+
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+    NanReturnValue(decoder->JpegDecodeSync());
+}
+
+NAN_METHOD(JpegDecoder::Dimensions)
+{
+    NanScope();
+
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+    NanReturnValue(decoder->Dimensions());
+}
+
+NAN_METHOD(JpegDecoder::SetScale)
+{
+    NanScope();
+
+    if (args.Length() != 1) {
+        return NanThrowError("One argument required - scale");
+    }
+
+    if (!args[0]->IsInt32()) {
+        return NanThrowError("First argument must be integer scale");
+    }
+
+    int s = args[0]->Int32Value();
+
+    if (s != 1 && s != 2 && s != 4 && s != 8) {
+        return NanThrowError("Scale must be 1, 2, 4 or 8 (output is 1/scale of the size).");
+    }
+
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+    decoder->SetScale(s);
+
+    NanReturnUndefined();
+}
+
+void
+JpegDecoder::UV_JpegDecode(uv_work_t *req)
+{
+    decode_request *dec_req = (decode_request *)req->data;
+
+    try {
+        dec_req->decompressor->decode();
+    }
+    catch (const char *err) {
+        dec_req->error = strdup(err);
+    }
+}
+
+void
+JpegDecoder::UV_JpegDecodeAfter(uv_work_t *req)
+{
+    NanScope();
+
+    decode_request *dec_req = (decode_request *)req->data;
+    delete req;
+    JpegDecoder *decoder = dec_req->decoder_obj;
+    JpegDecompressor *decompressor = dec_req->decompressor;
+
+    Handle<Value> argv[3];
+
+    if (dec_req->error) {
+        argv[0] = NanUndefined();
+        argv[1] = NanUndefined();
+        argv[2] = NanError(dec_req->error);
+    }
+    else {
+        int width = decompressor->get_width(), height = decompressor->get_height();
+        int len = width*height*bytes_per_pixel(decompressor->get_buf_type());
+        argv[0] = adopt_jpeg_buffer((char *)decompressor->release_pixels(), len);
+        argv[1] = decoder->Dimensions(width, height);
+        argv[2] = NanUndefined();
+    }
+
+    TryCatch try_catch;
+
+    dec_req->callback->Call(3, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    delete dec_req->callback;
+    delete decompressor;
+    free(dec_req->error);
+
+    decoder->Unref();
+    free(dec_req);
+}
+
+NAN_METHOD(JpegDecoder::JpegDecodeAsync)
+{
+    NanScope();
+
+    if (args.Length() != 1) {
+        return NanThrowError("One argument required - callback function.");
+    }
+
+    if (!args[0]->IsFunction()) {
+        return NanThrowError("First argument must be a function.");
+    }
+
+    Local<Function> callback = args[0].As<Function>();
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+
+    if (EncoderPool::full()) {
+        return NanThrowError("Encoder queue is full.");
+    }
+
+    decode_request *dec_req = (decode_request *)malloc(sizeof(*dec_req));
+    if (!dec_req) {
+        return NanThrowError("malloc in JpegDecoder::JpegDecodeAsync failed.");
+    }
+
+    // each decode gets its own decompressor, the header is read on the
+    // pool too so nothing proportional to the jpeg runs here
+    dec_req->callback = new NanCallback(callback);
+    dec_req->decoder_obj = decoder;
+    dec_req->decompressor = new JpegDecompressor(decoder->jpeg, decoder->jpeg_len, decoder->buf_type);
+    dec_req->decompressor->set_scale(decoder->scale_denom);
+    dec_req->error = NULL;
+
+    uv_work_t* req = new uv_work_t;
+    req->data = dec_req;
+    EncoderPool::queue(req, UV_JpegDecode, UV_JpegDecodeAfter);
+
+    decoder->Ref();
+
+    NanReturnUndefined();
+}
+
@@ -0,0 +1,37 @@
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#include <nan.h>
+#include <node.h>
+#include <node_buffer.h>
+
+#include "jpeg_decompressor.h"
+
+class JpegDecoder : public node::ObjectWrap {
+    const unsigned char *jpeg;
+    unsigned long jpeg_len;
+    buffer_type buf_type;
+    int scale_denom;
+    v8::Persistent<v8::Object> jpeg_buffer; // keeps `jpeg` alive
+
+    v8::Handle<v8::Value> Dimensions(int width, int height);
+
+    static void UV_JpegDecode(uv_work_t *req);
+    static void UV_JpegDecodeAfter(uv_work_t *req);
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    JpegDecoder(const unsigned char *jjpeg, unsigned long jjpeg_len, buffer_type bbuf_type);
+    ~JpegDecoder();
+    v8::Handle<v8::Value> JpegDecodeSync();
+    v8::Handle<v8::Value> Dimensions();
+    void SetScale(int denom);
+
+    static NAN_METHOD(New);
+    static NAN_METHOD(JpegDecodeSync);
+    static NAN_METHOD(JpegDecodeAsync);
+    static NAN_METHOD(Dimensions);
+    static NAN_METHOD(SetScale);
+};
+
+#endif
+
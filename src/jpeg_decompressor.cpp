@@ -0,0 +1,260 @@
+#include "jpeg_decompressor.h"
+#include <jerror.h>
+
+JpegDecompressor::JpegDecompressor(const unsigned char *jjpeg,
+    unsigned long jjpeg_len, buffer_type bbuf_type)
+    :
+      jpeg(jjpeg), jpeg_len(jjpeg_len), buf_type(bbuf_type), scale_denom(1),
+      pixels(NULL), row(NULL), width(0), height(0)
+{
+    error_message[0] = '\0';
+}
+
+JpegDecompressor::~JpegDecompressor() {
+    buffer_pool_release(pixels);
+    free(row);
+}
+
+/*
+ * Errors jump back to the setjmp in the caller instead of exiting, after
+ * saving libjpeg's message. Warnings (mostly about corrupt data that could
+ * still be decoded) are dropped rather than printed to stderr.
+ */
+
+static void
+jump_error_exit (j_common_ptr cinfo)
+{
+  jump_error_mgr * err = (jump_error_mgr *) cinfo->err;
+
+  (*cinfo->err->format_message) (cinfo, err->message);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+static void
+jump_output_message (j_common_ptr cinfo)
+{
+  /* nothing */
+}
+
+struct jpeg_error_mgr *
+jump_error (jump_error_mgr * err, char * message)
+{
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = jump_error_exit;
+  err->pub.output_message = jump_output_message;
+  err->message = message;
+  return &err->pub;
+}
+
+/*
+ * Source manager reading a jpeg that is in memory as a whole. Running out
+ * of data means the jpeg is truncated, which is ended with a fake EOI so
+ * that the part that is there still decodes.
+ */
+
+static const JOCTET fake_eoi[2] = { 0xFF, JPEG_EOI };
+
+static void
+init_buffer_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+static boolean
+fill_buffer_input (j_decompress_ptr cinfo)
+{
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+
+  cinfo->src->next_input_byte = fake_eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void
+skip_buffer_input (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr * src = cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+  if ((size_t) num_bytes > src->bytes_in_buffer) {
+    fill_buffer_input(cinfo);
+    return;
+  }
+  src->next_input_byte += num_bytes;
+  src->bytes_in_buffer -= num_bytes;
+}
+
+static void
+term_buffer_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+void
+jpeg_buffer_src (j_decompress_ptr cinfo,
+		 const unsigned char * buffer, unsigned long len)
+{
+  struct jpeg_source_mgr * src;
+
+  if (cinfo->src == NULL) {
+    cinfo->src = (struct jpeg_source_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  sizeof(struct jpeg_source_mgr));
+  }
+
+  src = cinfo->src;
+  src->init_source = init_buffer_source;
+  src->fill_input_buffer = fill_buffer_input;
+  src->skip_input_data = skip_buffer_input;
+  src->resync_to_restart = jpeg_resync_to_restart;
+  src->term_source = term_buffer_source;
+  src->next_input_byte = (const JOCTET *) buffer;
+  src->bytes_in_buffer = len;
+}
+
+// Turns a row of RGB from libjpeg into `buf_type`, alpha is opaque.
+static void
+rgb_to_buf_type(const unsigned char *rgb, unsigned char *dst, int pixels,
+    buffer_type buf_type)
+{
+    bool swap = buf_type == BUF_BGR || buf_type == BUF_BGRA;
+    int bpp = bytes_per_pixel(buf_type);
+
+    for (int i=0; i<pixels; i++, rgb+=3, dst+=bpp) {
+        dst[0] = rgb[swap ? 2 : 0];
+        dst[1] = rgb[1];
+        dst[2] = rgb[swap ? 0 : 2];
+        if (bpp == 4) dst[3] = 0xFF;
+    }
+}
+
+// Reads the header and works out the output size, then decodes the pixels
+// if `read_pixels` is set. Throws libjpeg's message for broken jpegs, which
+// lives in this object, so it must be caught before the object goes away.
+void
+JpegDecompressor::run(bool read_pixels)
+{
+    struct jpeg_decompress_struct cinfo;
+    jump_error_mgr jerr;
+
+    cinfo.err = jump_error(&jerr, error_message);
+
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        buffer_pool_release(pixels);
+        pixels = NULL;
+        free(row);
+        row = NULL;
+        throw (const char *)error_message;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_buffer_src(&cinfo, jpeg, jpeg_len);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // libjpeg scales in the IDCT, so smaller outputs are cheaper to decode
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale_denom;
+
+    bool expand = buf_type != BUF_RGB;
+    cinfo.out_color_space = JCS_RGB;
+#ifdef JCS_EXTENSIONS
+    // libjpeg-turbo writes BGR, RGBA and BGRA directly
+    switch (buf_type) {
+    case BUF_BGR: cinfo.out_color_space = JCS_EXT_BGR; break;
+    case BUF_RGBA: cinfo.out_color_space = JCS_EXT_RGBA; break;
+    case BUF_BGRA: cinfo.out_color_space = JCS_EXT_BGRA; break;
+    default: break;
+    }
+    expand = false;
+#endif
+
+    jpeg_calc_output_dimensions(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+
+    if (!read_pixels) {
+        jpeg_destroy_decompress(&cinfo);
+        return;
+    }
+
+    int bpp = bytes_per_pixel(buf_type);
+    size_t capacity;
+
+    buffer_pool_release(pixels);
+    pixels = buffer_pool_acquire((size_t)width*height*bpp, &capacity);
+    if (expand)
+        row = (unsigned char *)malloc(width*3);
+    if (!pixels || (expand && !row)) {
+        jpeg_destroy_decompress(&cinfo);
+        buffer_pool_release(pixels);
+        pixels = NULL;
+        free(row);
+        row = NULL;
+        throw "malloc failed in JpegDecompressor::decode.";
+    }
+
+    jpeg_start_decompress(&cinfo);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        unsigned char *dst = pixels + (size_t)cinfo.output_scanline*width*bpp;
+        JSAMPROW scanline = expand ? row : dst;
+        jpeg_read_scanlines(&cinfo, &scanline, 1);
+        if (expand)
+            rgb_to_buf_type(row, dst, width, buf_type);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    free(row);
+    row = NULL;
+}
+
+void
+JpegDecompressor::decode()
+{
+    run(true);
+}
+
+// Only reads the header, for the output size without decoding.
+void
+JpegDecompressor::read_dimensions()
+{
+    run(false);
+}
+
+// Decodes at 1/denom of the size, denom is 1, 2, 4 or 8.
+void
+JpegDecompressor::set_scale(int denom)
+{
+    scale_denom = denom;
+}
+
+// Gives up ownership of the decoded pixels; the caller must hand them back
+// with buffer_pool_release().
+unsigned char *
+JpegDecompressor::release_pixels()
+{
+    unsigned char *ret = pixels;
+    pixels = NULL;
+    return ret;
+}
+
+int
+JpegDecompressor::get_width() const
+{
+    return width;
+}
+
+int
+JpegDecompressor::get_height() const
+{
+    return height;
+}
+
+buffer_type
+JpegDecompressor::get_buf_type() const
+{
+    return buf_type;
+}
+
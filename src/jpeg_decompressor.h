@@ -0,0 +1,55 @@
+#ifndef JPEG_DECOMPRESSOR_H
+#define JPEG_DECOMPRESSOR_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <csetjmp>
+#include <jpeglib.h>
+#include "common.h"
+#include "buffer_pool.h"
+
+// libjpeg error manager that longjmps to setjmp_buffer with the error's
+// text in `message` (JMSG_LENGTH_MAX bytes) rather than exiting.
+struct jump_error_mgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+    char *message;
+};
+
+struct jpeg_error_mgr *jump_error(jump_error_mgr *err, char *message);
+
+// Reads a jpeg held in memory as a whole.
+void jpeg_buffer_src(j_decompress_ptr cinfo, const unsigned char *buffer,
+    unsigned long len);
+
+class JpegDecompressor {
+    const unsigned char *jpeg;
+    unsigned long jpeg_len;
+    buffer_type buf_type;
+    int scale_denom; // output is 1/scale_denom of the jpeg's size
+
+    unsigned char *pixels; // from buffer_pool.cpp
+    unsigned char *row;    // RGB scanline when libjpeg can't produce buf_type
+    int width, height;
+
+    char error_message[JMSG_LENGTH_MAX]; // what libjpeg errors throw
+
+    void run(bool read_pixels);
+
+public:
+    JpegDecompressor(const unsigned char *jjpeg, unsigned long jjpeg_len,
+        buffer_type bbuf_type);
+    ~JpegDecompressor();
+
+    void decode();
+    void read_dimensions();
+    void set_scale(int denom);
+
+    unsigned char *release_pixels();
+    int get_width() const;
+    int get_height() const;
+    buffer_type get_buf_type() const;
+};
+
+#endif
+
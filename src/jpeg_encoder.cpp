@@ -1,63 +1,62 @@
+#include <uv.h>
+#include <cmath>
 #include "jpeg_encoder.h"
+#include "encode_cache.h"
 
 JpegEncoder::JpegEncoder(unsigned char *ddata, int wwidth, int hheight,
     int qquality, buffer_type bbuf_type)
     :
       data(ddata), width(wwidth), height(hheight), quality(qquality), smoothing(0),
     buf_type(bbuf_type),
-    jpeg(NULL), jpeg_len(0),
+    parallel(false), row_cache(NULL), row_provider(NULL), cacheable(false),
+    jpeg(NULL), jpeg_len(0), size_hint(0),
     offset(0, 0, 0, 0) {}
 
 JpegEncoder::~JpegEncoder() {
-    free(jpeg);
+    buffer_pool_release(jpeg);
 }
 
-#if JPEG_LIB_VERSION < 80
-// copied over from latest libjpeg
-
-#define OUTPUT_BUF_SIZE 4096
+/*
+ * Destination manager writing into buffers from buffer_pool.cpp. The first
+ * buffer is sized from a prediction of the output size, so in the steady
+ * state the output never has to be grown and copied.
+ */
 
 typedef struct {
   struct jpeg_destination_mgr pub; /* public fields */
 
   unsigned char ** outbuffer;	/* target buffer */
   unsigned long * outsize;
-  unsigned char * newbuffer;	/* newly allocated buffer */
   JOCTET * buffer;		/* start of buffer */
   size_t bufsize;
-} my_mem_destination_mgr;
+} pool_destination_mgr;
 
-typedef my_mem_destination_mgr * my_mem_dest_ptr;
+typedef pool_destination_mgr * pool_dest_ptr;
 
-void
-init_mem_destination (j_compress_ptr cinfo)
+static void
+init_pool_destination (j_compress_ptr cinfo)
 {
-  /* no work necessary here */
+  /* no work necessary here, jpeg_pool_dest allocated the buffer */
 }
 
-boolean
-empty_mem_output_buffer (j_compress_ptr cinfo)
+static boolean
+empty_pool_output_buffer (j_compress_ptr cinfo)
 {
   size_t nextsize;
   JOCTET * nextbuffer;
-  my_mem_dest_ptr dest = (my_mem_dest_ptr) cinfo->dest;
+  pool_dest_ptr dest = (pool_dest_ptr) cinfo->dest;
 
   /* Try to allocate new buffer with double size */
-  nextsize = dest->bufsize * 2;
-  nextbuffer = (JOCTET *)malloc(nextsize);
+  nextbuffer = buffer_pool_acquire(dest->bufsize * 2, &nextsize);
 
   if (nextbuffer == NULL)
-    throw "malloc failed in empty_mem_output_buffer";
+    throw "malloc failed in empty_pool_output_buffer";
 
   memcpy(nextbuffer, dest->buffer, dest->bufsize);
-
-  if (dest->newbuffer != NULL)
-    free(dest->newbuffer);
-
-  dest->newbuffer = nextbuffer;
+  buffer_pool_release(dest->buffer);
 
   dest->pub.next_output_byte = nextbuffer + dest->bufsize;
-  dest->pub.free_in_buffer = dest->bufsize;
+  dest->pub.free_in_buffer = nextsize - dest->bufsize;
 
   dest->buffer = nextbuffer;
   dest->bufsize = nextsize;
@@ -65,118 +64,787 @@ empty_mem_output_buffer (j_compress_ptr cinfo)
   return TRUE;
 }
 
-void
-term_mem_destination (j_compress_ptr cinfo)
+static void
+term_pool_destination (j_compress_ptr cinfo)
 {
-  my_mem_dest_ptr dest = (my_mem_dest_ptr) cinfo->dest;
+  pool_dest_ptr dest = (pool_dest_ptr) cinfo->dest;
 
   *dest->outbuffer = dest->buffer;
   *dest->outsize = dest->bufsize - dest->pub.free_in_buffer;
+  dest->buffer = NULL;
 }
 
 void
-jpeg_mem_dest (j_compress_ptr cinfo,
-	       unsigned char ** outbuffer, unsigned long * outsize)
+jpeg_pool_dest (j_compress_ptr cinfo,
+	        unsigned char ** outbuffer, unsigned long * outsize,
+	        size_t expected_size)
 {
-  my_mem_dest_ptr dest;
+  pool_dest_ptr dest;
 
-  /* The destination object is made permanent so that multiple JPEG images
-   * can be written to the same buffer without re-executing jpeg_mem_dest.
+  /* The destination object is made permanent so that compressors reused
+   * through compressor_cache.cpp keep it.
    */
-  if (cinfo->dest == NULL) {	/* first time for this JPEG object? */
+  if (cinfo->dest == NULL ||
+      cinfo->dest->init_destination != init_pool_destination) {
     cinfo->dest = (struct jpeg_destination_mgr *)
       (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
-				  sizeof(my_mem_destination_mgr));
+				  sizeof(pool_destination_mgr));
   }
 
-  dest = (my_mem_dest_ptr) cinfo->dest;
-  dest->pub.init_destination = init_mem_destination;
-  dest->pub.empty_output_buffer = empty_mem_output_buffer;
-  dest->pub.term_destination = term_mem_destination;
+  dest = (pool_dest_ptr) cinfo->dest;
+  dest->pub.init_destination = init_pool_destination;
+  dest->pub.empty_output_buffer = empty_pool_output_buffer;
+  dest->pub.term_destination = term_pool_destination;
   dest->outbuffer = outbuffer;
   dest->outsize = outsize;
-  dest->newbuffer = NULL;
-
-  if (*outbuffer == NULL || *outsize == 0) {
-    /* Allocate initial buffer */
-    dest->newbuffer = *outbuffer = (unsigned char *)malloc(OUTPUT_BUF_SIZE);
-    if (dest->newbuffer == NULL)
-      throw "out of memory in jpeg_mem_dest (copied implementation)";
-    *outsize = OUTPUT_BUF_SIZE;
+
+  dest->buffer = buffer_pool_acquire(expected_size, &dest->bufsize);
+  if (dest->buffer == NULL)
+    throw "out of memory in jpeg_pool_dest";
+
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->bufsize;
+}
+
+/* Gives back the buffer of a compression that didn't finish. */
+void
+abort_pool_destination (j_compress_ptr cinfo)
+{
+  pool_dest_ptr dest = (pool_dest_ptr) cinfo->dest;
+
+  if (dest && dest->pub.init_destination == init_pool_destination) {
+    buffer_pool_release(dest->buffer);
+    dest->buffer = NULL;
   }
+}
 
-  dest->pub.next_output_byte = dest->buffer = *outbuffer;
-  dest->pub.free_in_buffer = dest->bufsize = *outsize;
+// Guess at the jpeg size before anything was encoded, on the generous side
+// of typical photos and screen content at this quality.
+static size_t
+initial_size_guess(int width, int height, int quality)
+{
+    return 1024 + (size_t)width*height*(quality + 20)/320;
 }
+
+// Number of scanlines handed to libjpeg per jpeg_write_scanlines call. When
+// rows need converting to RGB only this many converted rows exist at a time.
+#define STRIP_ROWS 16
+
+// Compressor settings for the encoder's options, and the converter rows
+// need if libjpeg can't read the buffer type.
+void
+JpegEncoder::prepare(compress_settings *s, row_converter *convert) const
+{
+    if (buf_type != BUF_RGB && buf_type != BUF_BGR &&
+        buf_type != BUF_RGBA && buf_type != BUF_BGRA)
+    {
+        throw "Unexpected buf_type in JpegEncoder::encode";
+    }
+
+    compress_settings &settings = *s;
+    *convert = NULL;
+    settings.quality = quality;
+    settings.smoothing = smoothing;
+    settings.subsampling = options.subsampling;
+    settings.dct_method = options.dct_method;
+    settings.optimize = options.optimize;
+    settings.progressive = options.progressive;
+    settings.arithmetic = options.arithmetic;
+#ifdef JCS_EXTENSIONS
+    // libjpeg-turbo reads BGR, RGBA and BGRA directly, no conversion needed
+    settings.input_components = bytes_per_pixel(buf_type);
+    switch (buf_type) {
+    case BUF_BGR: settings.in_color_space = JCS_EXT_BGR; break;
+    case BUF_RGBA: settings.in_color_space = JCS_EXT_RGBA; break;
+    case BUF_BGRA: settings.in_color_space = JCS_EXT_BGRA; break;
+    default: settings.in_color_space = JCS_RGB; break;
+    }
+#else
+    settings.input_components = 3;
+    settings.in_color_space = JCS_RGB;
+    *convert = rgb_row_converter(buf_type);
 #endif
+}
 
 void
 JpegEncoder::encode()
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    uint64_t start = uv_hrtime();
+
+    compress_settings settings;
+    row_converter convert;
+    prepare(&settings, &convert);
+
+    int image_width, image_height;
+    output_size(&image_width, &image_height);
+
+    // a previous jpeg that nobody released is written over
+    buffer_pool_release(jpeg);
+    jpeg = NULL;
+    jpeg_len = 0;
+
+    // Only a single array of pixels can be hashed. The hash is computed on
+    // the encoding thread, a hit costs it and a copy of the jpeg.
+    encode_cache_key cache_key;
+    bool cached = cacheable && !row_cache && !row_provider && EncodeCache::enabled();
+    if (cached) {
+        cache_key.hash = pixel_hash(data, (size_t)width*height*bytes_per_pixel(buf_type));
+        cache_key.width = width;
+        cache_key.height = height;
+        cache_key.quality = quality;
+        cache_key.smoothing = smoothing;
+        cache_key.buf_type = buf_type;
+        cache_key.parallel = parallel;
+        cache_key.rect = offset;
+        cache_key.options = options;
+
+        if (EncodeCache::lookup(cache_key, &jpeg, &jpeg_len)) {
+            stats.bytes = jpeg_len;
+            stats.time = (uv_hrtime() - start)/1e6;
+            stats.cached = true;
+            stats.quality = quality;
+            stats.trials = 0;
+            stats.over_budget = false;
+            return;
+        }
+    }
+
+    size_t expected_size = size_hint ? size_hint + size_hint/4 :
+        initial_size_guess(image_width, image_height, quality);
+
+    bool done = row_cache && encode_incremental(settings, convert, expected_size);
+    if (!done && (!parallel || !encode_striped(settings, convert, expected_size))) {
+        compress(settings, convert, 0, image_height, 0,
+            &jpeg, &jpeg_len, expected_size);
+    }
+
+    // running average of the output size, predicts the next encode's size
+    size_hint = size_hint ? (3*size_hint + jpeg_len)/4 : jpeg_len;
+
+    if (cached)
+        EncodeCache::insert(cache_key, jpeg, jpeg_len);
+
+    stats.bytes = jpeg_len;
+    stats.time = (uv_hrtime() - start)/1e6;
+    stats.cached = false;
+    stats.quality = quality;
+    stats.trials = 1;
+    stats.over_budget = false;
+}
+
+/*
+ * Encoding to a byte budget. Jpeg sizes follow a power of libjpeg's scaling
+ * of the quantization tables closely enough that interpolating log(size)
+ * over log(scale) between the closest qualities known to fit and not to
+ * fit mostly lands within a quality or two, which takes about 4 encodes
+ * where bisecting 1..100 takes 7. The search starts at the set quality and
+ * ends with the highest one that fits, or quality 1 if nothing does.
+ */
+
+// libjpeg's scaling of the standard tables for `quality`, in percent
+static double
+quality_scale(int quality)
+{
+    if (quality >= 100) return 1; // all steps are 1 from here on anyway
+    return quality < 50 ? 5000.0/quality : 200 - 2*quality;
+}
+
+// The highest quality whose tables are scaled by at least `scale` percent.
+static int
+scale_quality(double scale)
+{
+    return (int)floor(scale > 100 ? 5000/scale : (200 - scale)/2);
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
+// How much log(size) changes per log(scale) before two sizes are known.
+#define SIZE_SCALE_SLOPE -0.55
 
-    jpeg_create_compress(&cinfo);
-    jpeg_mem_dest(&cinfo, &jpeg, &jpeg_len);
+void
+JpegEncoder::encode_to_size(unsigned long max_bytes)
+{
+    uint64_t start = uv_hrtime();
+
+    compress_settings settings;
+    row_converter convert;
+    prepare(&settings, &convert);
+
+    int image_width, image_height;
+    output_size(&image_width, &image_height);
+
+    buffer_pool_release(jpeg);
+    jpeg = NULL;
+    jpeg_len = 0;
+
+    int max_quality = quality < 1 ? 1 : quality;
+    int fit = 0, over = max_quality + 1; // closest qualities tried
+    unsigned long fit_len = 0, over_len = 0;
+    unsigned char *fit_jpeg = NULL, *over_jpeg = NULL;
+    int trials = 0;
+
+    try {
+        int q = max_quality;
+        for (;;) {
+            settings.quality = q;
+            size_t expected_size = over_len ? over_len :
+                size_hint ? size_hint + size_hint/4 :
+                initial_size_guess(image_width, image_height, q);
+            if (!parallel || !encode_striped(settings, convert, expected_size)) {
+                compress(settings, convert, 0, image_height, 0,
+                    &jpeg, &jpeg_len, expected_size);
+            }
+            trials++;
+
+            if (jpeg_len <= max_bytes) {
+                buffer_pool_release(fit_jpeg);
+                fit_jpeg = jpeg;
+                fit_len = jpeg_len;
+                fit = q;
+            }
+            else {
+                buffer_pool_release(over_jpeg);
+                over_jpeg = jpeg;
+                over_len = jpeg_len;
+                over = q;
+            }
+            jpeg = NULL;
+            jpeg_len = 0;
+            if (over - fit <= 1)
+                break;
+
+            double slope = SIZE_SCALE_SLOPE;
+            if (fit) {
+                slope = log((double)over_len/fit_len)/
+                    log(quality_scale(over)/quality_scale(fit));
+            }
+            q = scale_quality(quality_scale(over)*
+                exp(log((double)max_bytes/over_len)/slope));
+            if (q <= fit) q = fit + 1;
+            if (q >= over) q = over - 1;
+        }
+    }
+    catch (...) {
+        buffer_pool_release(fit_jpeg);
+        buffer_pool_release(over_jpeg);
+        throw;
+    }
 
-    if (offset.isNull()) {
-        cinfo.image_width = width;
-        cinfo.image_height = height;
+    if (fit) {
+        buffer_pool_release(over_jpeg);
+        jpeg = fit_jpeg;
+        jpeg_len = fit_len;
     }
     else {
-        cinfo.image_width = offset.w;
-        cinfo.image_height = offset.h;
+        jpeg = over_jpeg;
+        jpeg_len = over_len;
     }
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    cinfo.smoothing_factor = smoothing;
-    jpeg_start_compress(&cinfo, TRUE);
+    stats.bytes = jpeg_len;
+    stats.time = (uv_hrtime() - start)/1e6;
+    stats.cached = false;
+    stats.quality = fit ? fit : over;
+    stats.trials = trials;
+    stats.over_budget = !fit;
+}
 
-    unsigned char *rgb_data;
-    switch (buf_type) {
-    case BUF_RGBA:
-        rgb_data = rgba_to_rgb(data, width*height*4);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/rgba_to_rgb.";
-        break;
-
-    case BUF_BGRA:
-        rgb_data = bgra_to_rgb(data, width*height*4);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/bgra_to_rgb.";
-        break;
-
-    case BUF_BGR:
-        rgb_data = bgr_to_rgb(data, width*height*3);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/bgr_to_rgb.";
-        break;
-
-    case BUF_RGB:
-        rgb_data = data;
-        break;
-
-    default:
-        throw "Unexpected buf_type in JpegEncoder::encode";
+// Size of the jpeg: the image, or its rect, resized as the options ask.
+void
+JpegEncoder::output_size(int *w, int *h) const
+{
+    int image_width = offset.isNull() ? width : offset.w;
+    int image_height = offset.isNull() ? height : offset.h;
+    resize_dimensions(image_width, image_height,
+        options.target_width, options.target_height, w, h);
+}
+
+// Row `y` of the image, or of its rect. Rows of a RowProvider may be
+// copied to `scratch`, which has room for one row.
+const unsigned char *
+JpegEncoder::source_row(int y, unsigned char *scratch) const
+{
+    int x0 = offset.isNull() ? 0 : offset.x;
+    int y0 = offset.isNull() ? 0 : offset.y;
+    if (row_provider)
+        return row_provider->row(y0 + y, x0, offset.isNull() ? width : offset.w, scratch);
+    return data + ((size_t)(y0 + y)*width + x0)*bytes_per_pixel(buf_type);
+}
+
+// Compresses `rows` rows of the image starting at `first_row` into a
+// complete jpeg of that height. Only reads the encoder, so several stripes
+// of one image can be compressed at once. Resized rows are made as they are
+// needed, the same way as rows converted to RGB.
+void
+JpegEncoder::compress(const compress_settings &settings, row_converter convert,
+    int first_row, int rows, unsigned int restart_interval,
+    unsigned char **out, unsigned long *out_len, size_t expected_size) const
+{
+    int bpp = bytes_per_pixel(buf_type);
+    int source_width = offset.isNull() ? width : offset.w;
+    int image_width, image_height;
+    output_size(&image_width, &image_height);
+
+    Resizer resizer;
+    resizer.setup(source_width, offset.isNull() ? height : offset.h,
+        image_width, image_height, bpp, options.filter);
+
+    // a RowProvider may need room for every source row in use at once
+    int fetch_rows = !row_provider ? 0 :
+        resizer.active() ? resizer.max_rows() : STRIP_ROWS;
+    std::vector<const unsigned char *> source_rows(
+        resizer.active() ? resizer.max_rows() : 1);
+
+    unsigned char *strip = NULL, *resized = NULL, *fetched = NULL;
+    if (convert)
+        strip = (unsigned char *)malloc(STRIP_ROWS*image_width*3);
+    if (resizer.active())
+        resized = (unsigned char *)malloc(STRIP_ROWS*image_width*bpp);
+    if (fetch_rows)
+        fetched = (unsigned char *)malloc((size_t)fetch_rows*source_width*bpp);
+    if ((convert && !strip) || (resizer.active() && !resized) ||
+        (fetch_rows && !fetched))
+    {
+        free(strip);
+        free(resized);
+        free(fetched);
+        throw "malloc failed in JpegEncoder::encode.";
+    }
+
+    compressor *c;
+    try {
+        c = compressor_acquire(settings);
+    }
+    catch (...) {
+        free(strip);
+        free(resized);
+        free(fetched);
+        throw;
+    }
+    j_compress_ptr cinfo = &c->cinfo;
+
+    try {
+        jpeg_pool_dest(cinfo, out, out_len, expected_size);
+        cinfo->image_width = image_width;
+        cinfo->image_height = rows;
+        cinfo->restart_interval = restart_interval;
+        cinfo->restart_in_rows = 0;
+        jpeg_start_compress(cinfo, TRUE);
+
+        JSAMPROW row_pointers[STRIP_ROWS];
+        size_t fetched_stride = (size_t)source_width*bpp;
+        while (cinfo->next_scanline < cinfo->image_height) {
+            int n = cinfo->image_height - cinfo->next_scanline;
+            if (n > STRIP_ROWS) n = STRIP_ROWS;
+
+            for (int i = 0; i < n; i++) {
+                int y = first_row + cinfo->next_scanline + i;
+                const unsigned char *row;
+                if (resized) {
+                    int first, count;
+                    resizer.source_rows(y, &first, &count);
+                    for (int k = 0; k < count; k++) {
+                        source_rows[k] = source_row(first + k,
+                            fetched + k*fetched_stride);
+                    }
+                    unsigned char *resized_row = resized + i*image_width*bpp;
+                    resizer.row(&source_rows[0], y, resized_row);
+                    row = resized_row;
+                }
+                else {
+                    row = source_row(y, fetched + i*fetched_stride);
+                }
+                if (convert) {
+                    unsigned char *rgb_row = strip + i*image_width*3;
+                    convert(row, rgb_row, image_width);
+                    row_pointers[i] = rgb_row;
+                }
+                else {
+                    row_pointers[i] = (JSAMPROW)row;
+                }
+            }
+            jpeg_write_scanlines(cinfo, row_pointers, n);
+        }
+
+        jpeg_finish_compress(cinfo);
+    }
+    catch (...) {
+        free(strip);
+        free(resized);
+        free(fetched);
+        abort_pool_destination(cinfo);
+        compressor_discard(c);
+        throw;
+    }
+
+    free(strip);
+    free(resized);
+    free(fetched);
+    compressor_release(c);
+}
+
+/*
+ * Striped encoding. The image is cut into horizontal stripes of whole MCU
+ * rows which are compressed as separate jpegs on the encoder pool, all with
+ * a restart interval of exactly one stripe. Restart intervals reset the
+ * DC prediction and byte-align the entropy coded data, so the stripes' scans
+ * concatenated with RSTn markers between them are the scan the serial
+ * encoder would have produced for that restart interval.
+ */
+
+// Stripes below this many pixels cost more in setup than they save.
+#define MIN_STRIPE_PIXELS (256*1024)
+
+struct stripe_job {
+    const JpegEncoder *encoder;
+    const compress_settings *settings;
+    row_converter convert;
+    int stripe_rows, image_height;
+    unsigned int restart_interval;
+    size_t expected_size;
+    unsigned char **jpegs;
+    unsigned long *lens;
+    const char *error;
+};
+
+void
+JpegEncoder::encode_stripe(void *arg, int i)
+{
+    stripe_job *job = (stripe_job *)arg;
+    int first_row = i*job->stripe_rows;
+    int rows = job->image_height - first_row;
+    if (rows > job->stripe_rows) rows = job->stripe_rows;
+
+    try {
+        job->encoder->compress(*job->settings, job->convert, first_row, rows,
+            job->restart_interval, &job->jpegs[i], &job->lens[i],
+            job->expected_size);
+    }
+    catch (const char *err) {
+        job->error = err;
+    }
+}
+
+// Offset of the entropy coded data of a complete jpeg, just past its SOS
+// segment. Returns 0 if the markers don't parse.
+static size_t
+scan_offset(const unsigned char *jpeg, size_t len)
+{
+    size_t pos = 2; // SOI
+    while (pos + 4 <= len && jpeg[pos] == 0xFF) {
+        int marker = jpeg[pos+1];
+        pos += 2 + ((jpeg[pos+2] << 8) | jpeg[pos+3]);
+        if (marker == 0xDA)
+            return pos <= len - 2 ? pos : 0;
+    }
+    return 0;
+}
+
+// Rewrites the image height in the SOFn segment of a jpeg header.
+static bool
+patch_frame_height(unsigned char *header, size_t len, int height)
+{
+    size_t pos = 2;
+    while (pos + 9 <= len && header[pos] == 0xFF) {
+        int marker = header[pos+1];
+        if (marker >= 0xC0 && marker <= 0xCF &&
+            marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            header[pos+5] = (height >> 8) & 0xFF;
+            header[pos+6] = height & 0xFF;
+            return true;
+        }
+        pos += 2 + ((header[pos+2] << 8) | header[pos+3]);
     }
+    return false;
+}
+
+// Joins the entropy coded data of consecutive restart intervals into one
+// jpeg: `header` with the frame height fixed up, the scans separated by
+// RSTn, then EOI.
+static unsigned char *
+join_scans(const unsigned char *header, size_t header_len,
+    const unsigned char **scans, const size_t *scan_lens, int n,
+    int image_height, unsigned long *out_len)
+{
+    size_t total = header_len + 2*n;
+    for (int i = 0; i < n; i++)
+        total += scan_lens[i];
+
+    size_t capacity;
+    unsigned char *out = buffer_pool_acquire(total, &capacity);
+    if (!out)
+        return NULL;
+
+    memcpy(out, header, header_len);
+    if (!patch_frame_height(out, header_len, image_height)) {
+        buffer_pool_release(out);
+        return NULL;
+    }
+
+    unsigned char *p = out + header_len;
+    for (int i = 0; i < n; i++) {
+        if (i) {
+            *p++ = 0xFF;
+            *p++ = 0xD0 + (i-1)%8;
+        }
+        memcpy(p, scans[i], scan_lens[i]);
+        p += scan_lens[i];
+    }
+    *p++ = 0xFF;
+    *p++ = 0xD9;
+
+    *out_len = p - out;
+    return out;
+}
+
+// Joins the stripes, using the headers of the first one.
+static unsigned char *
+splice_stripes(unsigned char **jpegs, unsigned long *lens, int n,
+    int image_height, unsigned long *out_len)
+{
+    size_t header_len = scan_offset(jpegs[0], lens[0]);
+    if (!header_len)
+        return NULL;
+
+    std::vector<const unsigned char *> scans(n);
+    std::vector<size_t> scan_lens(n);
+    for (int i = 0; i < n; i++) {
+        size_t start = scan_offset(jpegs[i], lens[i]);
+        if (!start || jpegs[i][lens[i]-2] != 0xFF || jpegs[i][lens[i]-1] != 0xD9)
+            return NULL;
+        scans[i] = jpegs[i] + start;
+        scan_lens[i] = lens[i] - start - 2;
+    }
+
+    return join_scans(jpegs[0], header_len, &scans[0], &scan_lens[0], n,
+        image_height, out_len);
+}
+
+// Size in pixels of the MCUs the settings lead to.
+static void
+mcu_size(const compress_settings &settings, int *mcu_w, int *mcu_h)
+{
+    *mcu_w = *mcu_h = DCTSIZE;
+    compressor *c = compressor_acquire(settings);
+    for (int ci = 0; ci < c->cinfo.num_components; ci++) {
+        jpeg_component_info *comp = &c->cinfo.comp_info[ci];
+        if (comp->h_samp_factor*DCTSIZE > *mcu_w) *mcu_w = comp->h_samp_factor*DCTSIZE;
+        if (comp->v_samp_factor*DCTSIZE > *mcu_h) *mcu_h = comp->v_samp_factor*DCTSIZE;
+    }
+    compressor_release(c);
+}
 
-    JSAMPROW row_pointer;
-    int start = 0;
-    if (!offset.isNull()) {
-        start = offset.y*width*3 + offset.x*3;
+// Encodes the image in stripes on the encoder pool. Returns false without
+// doing anything when the image is too small or the settings can't be
+// striped, the caller then encodes serially.
+bool
+JpegEncoder::encode_striped(const compress_settings &settings,
+    row_converter convert, size_t expected_size)
+{
+    // smoothing looks at the rows around each row, which differ at stripe
+    // edges, and the other settings need one scan or Huffman table per image
+    if (settings.smoothing > 0 || settings.optimize ||
+        settings.progressive || settings.arithmetic)
+    {
+        return false;
     }
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer = &rgb_data[start + cinfo.next_scanline*3*width];
-        jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+
+    int threads = EncoderPool::size();
+    if (threads < 2)
+        return false;
+
+    int image_width, image_height;
+    output_size(&image_width, &image_height);
+
+    int mcu_w, mcu_h;
+    mcu_size(settings, &mcu_w, &mcu_h);
+
+    int mcus_per_row = (image_width + mcu_w - 1)/mcu_w;
+    int mcu_rows = (image_height + mcu_h - 1)/mcu_h;
+
+    // a couple of stripes per thread evens out stripes that compress slower
+    int stripes = 2*threads;
+    int max_stripes = (int)((long long)image_width*image_height/MIN_STRIPE_PIXELS);
+    if (stripes > max_stripes) stripes = max_stripes;
+    if (stripes > mcu_rows) stripes = mcu_rows;
+    if (stripes < 2)
+        return false;
+
+    // the restart interval is counted in MCUs and must fit in 16 bits
+    int stripe_mcu_rows = (mcu_rows + stripes - 1)/stripes;
+    if (stripe_mcu_rows*mcus_per_row > 65535)
+        stripe_mcu_rows = 65535/mcus_per_row;
+    if (stripe_mcu_rows < 1)
+        return false;
+    stripes = (mcu_rows + stripe_mcu_rows - 1)/stripe_mcu_rows;
+
+    unsigned char **jpegs = (unsigned char **)calloc(stripes, sizeof(*jpegs));
+    unsigned long *lens = (unsigned long *)calloc(stripes, sizeof(*lens));
+    if (!jpegs || !lens) {
+        free(jpegs);
+        free(lens);
+        throw "malloc failed in JpegEncoder::encode.";
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    stripe_job job;
+    job.encoder = this;
+    job.settings = &settings;
+    job.convert = convert;
+    job.stripe_rows = stripe_mcu_rows*mcu_h;
+    job.image_height = image_height;
+    job.restart_interval = stripe_mcu_rows*mcus_per_row;
+    job.expected_size = expected_size/stripes + 1024;
+    job.jpegs = jpegs;
+    job.lens = lens;
+    job.error = NULL;
+
+    EncoderPool::parallel_for(stripes, encode_stripe, &job);
+
+    if (!job.error) {
+        jpeg = splice_stripes(jpegs, lens, stripes, image_height, &jpeg_len);
+        if (!jpeg)
+            job.error = "Failed joining stripes in JpegEncoder::encode.";
+    }
 
-    if (buf_type == BUF_BGR || buf_type == BUF_RGBA || buf_type == BUF_BGRA)
-        free(rgb_data);
+    for (int i = 0; i < stripes; i++)
+        buffer_pool_release(jpegs[i]);
+    free(jpegs);
+    free(lens);
+
+    if (job.error)
+        throw job.error;
+    return true;
+}
+
+/*
+ * Incremental encoding. Every MCU row is a restart interval of its own, so
+ * the entropy coded data of a row only depends on the row's pixels and the
+ * tables. Runs of dirty rows are compressed as jpegs of their own, their
+ * scans cut at the RSTn markers and the pieces kept in the row cache. The
+ * jpeg is then joined from the cached rows like striped encodes are.
+ */
+
+// Splits a scan at its RSTn markers into `n` restart intervals. Data bytes
+// of 0xFF are always followed by 0x00, so markers can't be mistaken.
+static bool
+split_restart_intervals(const unsigned char *scan, size_t len, int n,
+    std::vector<unsigned char> *intervals)
+{
+    size_t start = 0;
+    int i = 0;
+    for (size_t pos = 0; pos + 1 < len; pos++) {
+        if (scan[pos] == 0xFF && scan[pos+1] >= 0xD0 && scan[pos+1] <= 0xD7) {
+            if (i == n - 1)
+                return false;
+            intervals[i++].assign(scan + start, scan + pos);
+            start = pos + 2;
+            pos++;
+        }
+    }
+    if (i != n - 1)
+        return false;
+    intervals[i].assign(scan + start, scan + len);
+    return true;
+}
+
+// Encodes using the row cache. Returns false without doing anything when
+// the settings can't be used with it, the caller then encodes the whole
+// image; the rows marked dirty stay so until an incremental encode.
+bool
+JpegEncoder::encode_incremental(const compress_settings &settings,
+    row_converter convert, size_t expected_size)
+{
+    // the same settings as striped encodes, and a restart interval per row
+    // must not depend on the rows around it, like it would when resizing
+    if (settings.smoothing > 0 || settings.optimize ||
+        settings.progressive || settings.arithmetic)
+    {
+        return false;
+    }
+
+    int image_width = offset.isNull() ? width : offset.w;
+    int image_height = offset.isNull() ? height : offset.h;
+    int out_width, out_height;
+    output_size(&out_width, &out_height);
+    if (out_width != image_width || out_height != image_height ||
+        image_width <= 0 || image_height <= 0)
+    {
+        return false;
+    }
+
+    int mcu_w, mcu_h;
+    mcu_size(settings, &mcu_w, &mcu_h);
+    int mcus_per_row = (image_width + mcu_w - 1)/mcu_w;
+    int mcu_rows = (image_height + mcu_h - 1)/mcu_h;
+    if (mcus_per_row > 65535)
+        return false;
+
+    McuRowCache *cache = row_cache;
+    if (cache->header.empty() || !(cache->settings == settings) ||
+        cache->width != image_width || cache->height != image_height)
+    {
+        cache->header.clear();
+        cache->rows.assign(mcu_rows, std::vector<unsigned char>());
+        cache->dirty.assign((image_height + DCTSIZE - 1)/DCTSIZE, true);
+        cache->settings = settings;
+        cache->width = image_width;
+        cache->height = image_height;
+    }
+    cache->dirty.resize((image_height + DCTSIZE - 1)/DCTSIZE, false);
+
+    int blocks_per_row = mcu_h/DCTSIZE;
+    std::vector<bool> redo(mcu_rows, false);
+    for (size_t i = 0; i < cache->dirty.size(); i++) {
+        if (cache->dirty[i])
+            redo[i/blocks_per_row] = true;
+    }
+
+    for (int first = 0; first < mcu_rows; ) {
+        if (!redo[first]) {
+            first++;
+            continue;
+        }
+        int n = 1;
+        while (first + n < mcu_rows && redo[first + n])
+            n++;
+
+        int first_row = first*mcu_h;
+        int rows = n*mcu_h;
+        if (first_row + rows > image_height)
+            rows = image_height - first_row;
+
+        unsigned char *run = NULL;
+        unsigned long run_len = 0;
+        compress(settings, convert, first_row, rows, mcus_per_row,
+            &run, &run_len, expected_size/mcu_rows*n + 1024);
+
+        size_t start = scan_offset(run, run_len);
+        bool ok = start && run[run_len-2] == 0xFF && run[run_len-1] == 0xD9 &&
+            split_restart_intervals(run + start, run_len - start - 2, n,
+                &cache->rows[first]);
+        if (ok && cache->header.empty())
+            cache->header.assign(run, run + start);
+        buffer_pool_release(run);
+        if (!ok)
+            throw "Failed splitting MCU rows in JpegEncoder::encode.";
+
+        for (int i = first*blocks_per_row;
+            i < (first + n)*blocks_per_row && i < (int)cache->dirty.size(); i++)
+        {
+            cache->dirty[i] = false;
+        }
+        first += n;
+    }
+
+    std::vector<const unsigned char *> scans(mcu_rows);
+    std::vector<size_t> scan_lens(mcu_rows);
+    for (int i = 0; i < mcu_rows; i++) {
+        scans[i] = cache->rows[i].empty() ? NULL : &cache->rows[i][0];
+        scan_lens[i] = cache->rows[i].size();
+    }
+    jpeg = join_scans(&cache->header[0], cache->header.size(), &scans[0],
+        &scan_lens[0], mcu_rows, image_height, &jpeg_len);
+    if (!jpeg)
+        throw "Failed joining MCU rows in JpegEncoder::encode.";
+    return true;
 }
 
 void
@@ -190,6 +858,51 @@ void JpegEncoder::set_smoothing(int ssmoothing)
     smoothing  = ssmoothing;
 }
 
+void
+JpegEncoder::set_parallel(bool pparallel)
+{
+    parallel = pparallel;
+}
+
+// Reads the image's rows from `provider` instead of the pixel array, which
+// may be NULL then. The provider has to outlive the encodes.
+void
+JpegEncoder::set_row_provider(const RowProvider *provider)
+{
+    row_provider = provider;
+}
+
+void
+JpegEncoder::set_cacheable(bool ccacheable)
+{
+    cacheable = ccacheable;
+}
+
+// Encodes incrementally with `cache`, which the caller has acquired.
+void
+JpegEncoder::set_row_cache(McuRowCache *cache)
+{
+    row_cache = cache;
+}
+
+void
+JpegEncoder::set_options(const encoder_options &ooptions)
+{
+    options = ooptions;
+}
+
+const encoder_options &
+JpegEncoder::get_options() const
+{
+    return options;
+}
+
+const encode_stats &
+JpegEncoder::get_stats() const
+{
+    return stats;
+}
+
 const unsigned char *
 JpegEncoder::get_jpeg() const
 {
@@ -202,9 +915,38 @@ JpegEncoder::get_jpeg_len() const
     return jpeg_len;
 }
 
+// Gives up ownership of the encoded jpeg; the caller must hand it back with
+// buffer_pool_release(). The next encode() starts from a fresh output buffer.
+unsigned char *
+JpegEncoder::release_jpeg()
+{
+    unsigned char *ret = jpeg;
+    jpeg = NULL;
+    jpeg_len = 0;
+    return ret;
+}
+
+void
+JpegEncoder::set_size_hint(unsigned long hint)
+{
+    size_hint = hint;
+}
+
+unsigned long
+JpegEncoder::get_size_hint() const
+{
+    return size_hint;
+}
+
 void
 JpegEncoder::setRect(const Rect &r)
 {
     offset = r;
 }
 
+const Rect &
+JpegEncoder::getRect() const
+{
+    return offset;
+}
+
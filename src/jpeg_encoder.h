@@ -5,29 +5,82 @@
 #include <cstdlib>
 #include <jpeglib.h>
 #include "common.h"
+#include "buffer_pool.h"
+#include "compressor_cache.h"
+#include "encoder_pool.h"
+#include "mcu_row_cache.h"
+
+// Destination manager writing into buffers from buffer_pool.cpp, sized
+// from `expected_size` and grown when the jpeg doesn't fit.
+void jpeg_pool_dest(j_compress_ptr cinfo, unsigned char **outbuffer,
+    unsigned long *outsize, size_t expected_size);
+void abort_pool_destination(j_compress_ptr cinfo);
+
+// Supplies the rows of an image that isn't one array of pixels.
+class RowProvider {
+public:
+    virtual ~RowProvider() {}
+
+    // Returns `w` pixels of row `y` starting at `x`, in the encoder's
+    // buffer type. May copy them to `scratch`, which has room for w pixels.
+    // Called from encoder threads, possibly several at once.
+    virtual const unsigned char *row(int y, int x, int w,
+        unsigned char *scratch) const = 0;
+};
 
 class JpegEncoder {
     int width, height, quality, smoothing;
     buffer_type buf_type;
     unsigned char *data;
+    bool parallel; // split large images into stripes encoded on the pool
+    McuRowCache *row_cache; // only re-encode changed MCU rows, or NULL
+    const RowProvider *row_provider; // where rows come from if not `data`
+    bool cacheable; // look the pixels up in the EncodeCache
+    encoder_options options;
+    encode_stats stats;
 
     unsigned char *jpeg;
     long unsigned int jpeg_len;
+    unsigned long size_hint; // running average of recent output sizes
 
     Rect offset;
 
+    void prepare(compress_settings *settings, row_converter *convert) const;
+    void output_size(int *w, int *h) const;
+    const unsigned char *source_row(int y, unsigned char *scratch) const;
+    void compress(const compress_settings &settings, row_converter convert,
+        int first_row, int rows, unsigned int restart_interval,
+        unsigned char **out, unsigned long *out_len, size_t expected_size) const;
+    bool encode_striped(const compress_settings &settings,
+        row_converter convert, size_t expected_size);
+    static void encode_stripe(void *arg, int i);
+    bool encode_incremental(const compress_settings &settings,
+        row_converter convert, size_t expected_size);
+
 public:
     JpegEncoder(unsigned char *ddata, int wwidth, int hheight,
         int qquality, buffer_type bbuf_type);
     ~JpegEncoder();
 
     void encode();
+    void encode_to_size(unsigned long max_bytes);
     void set_quality(int qquality);
     void set_smoothing(int ssmoothing);
+    void set_parallel(bool pparallel);
+    void set_row_cache(McuRowCache *cache);
+    void set_row_provider(const RowProvider *provider);
+    void set_cacheable(bool ccacheable);
+    void set_options(const encoder_options &ooptions);
+    const encoder_options &get_options() const;
+    const encode_stats &get_stats() const;
     const unsigned char *get_jpeg() const;
     unsigned int get_jpeg_len() const;
+    unsigned char *release_jpeg();
+    void set_size_hint(unsigned long hint);
+    unsigned long get_size_hint() const;
 
     void setRect(const Rect &r);
+    const Rect &getRect() const;
 };
 
 #endif
@@ -0,0 +1,49 @@
+#include "mcu_row_cache.h"
+
+McuRowCache::McuRowCache() : busy(false), width(0), height(0) {}
+
+// Marks pixel rows y to y+h-1 as changed.
+void
+McuRowCache::mark_dirty(int y, int h)
+{
+    if (h <= 0)
+        return;
+
+    size_t last = (y + h - 1)/DCTSIZE;
+    if (pending.size() <= last)
+        pending.resize(last + 1, false);
+    for (size_t i = y/DCTSIZE; i <= last; i++)
+        pending[i] = true;
+}
+
+// Hands the rows pushed to since the last encode to the encoder. Returns
+// false if an encode still has the cache, the caller then encodes without.
+bool
+McuRowCache::acquire()
+{
+    if (busy)
+        return false;
+
+    if (dirty.size() < pending.size())
+        dirty.resize(pending.size(), false);
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (pending[i])
+            dirty[i] = true;
+    }
+    pending.assign(pending.size(), false);
+
+    busy = true;
+    return true;
+}
+
+// Gives the cache back after an encode. Rows of a failed encode might not
+// match the frame any more, so they are all thrown away.
+void
+McuRowCache::release(bool ok)
+{
+    busy = false;
+    if (!ok) {
+        header.clear();
+        rows.clear();
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef MCU_ROW_CACHE_H
+#define MCU_ROW_CACHE_H
+
+#include <vector>
+#include "compressor_cache.h"
+
+/*
+ * Entropy coded data of every MCU row of a stack's last jpeg, encoded with
+ * one restart interval per MCU row so that each row's data stands on its
+ * own. Pushes mark the rows they touch and the next encode only compresses
+ * those again, see JpegEncoder::encode_incremental.
+ *
+ * mark_dirty(), acquire() and release() must be called on the main thread.
+ * Between acquire() and release() the cache belongs to one encoder, which
+ * may run on the threadpool; pushes in that time are kept for the next one.
+ */
+class McuRowCache {
+    friend class JpegEncoder;
+
+    // dirtiness is kept per 8 pixel rows, an MCU row is one or two of them
+    std::vector<bool> pending; // marked by pushes
+    std::vector<bool> dirty;   // what the encoder has to redo
+
+    bool busy;
+
+    // what the cached rows were encoded with
+    compress_settings settings;
+    int width, height;
+    std::vector<unsigned char> header; // up to the SOS segment's end
+    std::vector<std::vector<unsigned char> > rows;
+
+public:
+    McuRowCache();
+
+    void mark_dirty(int y, int h);
+    bool acquire();
+    void release(bool ok);
+};
+
+#endif
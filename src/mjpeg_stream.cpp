@@ -0,0 +1,306 @@
+#include <nan.h>
+#include <node.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "common.h"
+#include "mjpeg_stream.h"
+#include "fixed_jpeg_stack.h"
+#include "dynamic_jpeg_stack.h"
+#include "encoder_pool.h"
+
+using namespace v8;
+using namespace node;
+
+// room for "--<boundary>\r\nContent-Type: image/jpeg\r\nContent-Length: <n>\r\n\r\n"
+#define PART_HEADER_EXTRA 128
+#define MAX_BOUNDARY 70 // RFC 2046
+
+struct mjpeg_request {
+    MjpegStream *stream;
+    encode_request *enc_req;
+    const char *boundary;
+    char *part; // from buffer_pool
+    size_t part_len;
+};
+
+static void
+free_timer(uv_handle_t *handle)
+{
+    delete (uv_timer_t *)handle;
+}
+
+void
+MjpegStream::Initialize(Handle<Object> target)
+{
+    NanScope();
+
+    Local<FunctionTemplate> t = NanNew<FunctionTemplate>(New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "start", Start);
+    NODE_SET_PROTOTYPE_METHOD(t, "stop", Stop);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
+    target->Set(NanNew<String>("MjpegStream"), t->GetFunction());
+}
+
+MjpegStream::MjpegStream(FrameSource *ssource, const std::string &bboundary,
+    double fps) :
+    source(ssource), boundary(bboundary), callback(NULL), encoding(false),
+    have_generation(false), last_generation(0),
+    frames(0), skipped_idle(0), skipped_busy(0)
+{
+    interval = (uint64_t)(1000/fps);
+    if (interval < 1)
+        interval = 1;
+
+    timer = new uv_timer_t;
+    uv_timer_init(uv_default_loop(), timer);
+    timer->data = this;
+}
+
+MjpegStream::~MjpegStream()
+{
+    // the stream is referenced while started, so the timer is stopped
+    uv_close((uv_handle_t *)timer, free_timer);
+    NanDisposePersistent(stack_obj);
+}
+
+void
+MjpegStream::Start(NanCallback *cb)
+{
+    callback = cb;
+    have_generation = false;
+    uv_timer_start(timer, OnTick, 0, interval);
+    Ref();
+}
+
+void
+MjpegStream::Stop()
+{
+    uv_timer_stop(timer);
+    delete callback;
+    callback = NULL;
+    Unref();
+}
+
+#if UV_VERSION_MAJOR >= 1
+void
+MjpegStream::OnTick(uv_timer_t *handle)
+#else
+void
+MjpegStream::OnTick(uv_timer_t *handle, int status)
+#endif
+{
+    ((MjpegStream *)handle->data)->Tick();
+}
+
+void
+MjpegStream::Tick()
+{
+    if (encoding || EncoderPool::full()) {
+        skipped_busy++;
+        return;
+    }
+
+    unsigned long generation = source->generation();
+    if (have_generation && generation == last_generation) {
+        skipped_idle++;
+        return;
+    }
+    // a failing frame is reported once, not on every tick until a push
+    have_generation = true;
+    last_generation = generation;
+
+    mjpeg_request *mjpeg_req = (mjpeg_request *)malloc(sizeof(*mjpeg_req));
+    if (!mjpeg_req) {
+        skipped_busy++;
+        return;
+    }
+
+    try {
+        mjpeg_req->enc_req = source->begin_encode();
+    }
+    catch (const char *err) {
+        free(mjpeg_req);
+
+        NanScope();
+        Handle<Value> argv[2] = { NanUndefined(), NanError(err) };
+        callback->Call(2, argv);
+        return;
+    }
+    mjpeg_req->stream = this;
+    mjpeg_req->boundary = boundary.c_str();
+    mjpeg_req->part = NULL;
+    mjpeg_req->part_len = 0;
+
+    encoding = true;
+    uv_work_t *req = new uv_work_t;
+    req->data = mjpeg_req;
+    EncoderPool::queue(req, UV_Encode, UV_EncodeAfter);
+    Ref();
+}
+
+// Encodes the frame and wraps it into a multipart part with one copy.
+void
+MjpegStream::UV_Encode(uv_work_t *req)
+{
+    mjpeg_request *mjpeg_req = (mjpeg_request *)req->data;
+    encode_request *enc_req = mjpeg_req->enc_req;
+
+    run_encode(enc_req);
+    if (enc_req->error)
+        return;
+
+    size_t capacity;
+    size_t max_len = strlen(mjpeg_req->boundary) + PART_HEADER_EXTRA + enc_req->jpeg_len;
+    unsigned char *part = buffer_pool_acquire(max_len, &capacity);
+    if (!part) {
+        enc_req->error = strdup("malloc failed in MjpegStream.");
+        return;
+    }
+
+    int header_len = snprintf((char *)part, max_len,
+        "--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n",
+        mjpeg_req->boundary, enc_req->jpeg_len);
+    memcpy(part + header_len, enc_req->jpeg, enc_req->jpeg_len);
+    memcpy(part + header_len + enc_req->jpeg_len, "\r\n", 2);
+
+    buffer_pool_release((unsigned char *)enc_req->jpeg);
+    enc_req->jpeg = NULL;
+    mjpeg_req->part = (char *)part;
+    mjpeg_req->part_len = header_len + enc_req->jpeg_len + 2;
+}
+
+void
+MjpegStream::UV_EncodeAfter(uv_work_t *req)
+{
+    NanScope();
+
+    mjpeg_request *mjpeg_req = (mjpeg_request *)req->data;
+    delete req;
+    MjpegStream *stream = mjpeg_req->stream;
+    encode_request *enc_req = mjpeg_req->enc_req;
+
+    stream->source->end_encode(enc_req);
+    stream->encoding = false;
+
+    // a frame that finishes after stop() is dropped
+    if (stream->callback) {
+        Handle<Value> argv[2];
+        if (enc_req->error) {
+            argv[0] = NanUndefined();
+            argv[1] = NanError(enc_req->error);
+        }
+        else {
+            argv[0] = adopt_jpeg_buffer(mjpeg_req->part, mjpeg_req->part_len);
+            argv[1] = NanUndefined();
+            mjpeg_req->part = NULL; // owned by the Buffer now
+            stream->frames++;
+        }
+        stream->callback->Call(2, argv);
+    }
+
+    buffer_pool_release((unsigned char *)mjpeg_req->part);
+    buffer_pool_release((unsigned char *)enc_req->jpeg);
+    free(enc_req->error);
+    free(enc_req);
+    free(mjpeg_req);
+
+    stream->Unref();
+}
+
+NAN_METHOD(MjpegStream::New)
+{
+    NanScope();
+
+    if (args.Length() < 1) {
+        return NanThrowError("At least one argument required - stack, [and options {fps, boundary}].");
+    }
+
+    FrameSource *source;
+    if (NanHasInstance(FixedJpegStack::constructor_template, args[0]))
+        source = ObjectWrap::Unwrap<FixedJpegStack>(args[0]->ToObject());
+    else if (NanHasInstance(DynamicJpegStack::constructor_template, args[0]))
+        source = ObjectWrap::Unwrap<DynamicJpegStack>(args[0]->ToObject());
+    else
+        return NanThrowError("First argument must be a FixedJpegStack or DynamicJpegStack.");
+
+    double fps = 10;
+    std::string boundary = "mjpegframe";
+    if (args.Length() >= 2) {
+        if (!args[1]->IsObject()) {
+            return NanThrowError("Second argument must be an options object {fps, boundary}.");
+        }
+        Local<Object> opts = args[1]->ToObject();
+        Local<Value> fps_val = opts->Get(NanNew<String>("fps"));
+        Local<Value> boundary_val = opts->Get(NanNew<String>("boundary"));
+
+        if (!fps_val->IsUndefined()) {
+            if (!fps_val->IsNumber() || fps_val->NumberValue() <= 0 ||
+                fps_val->NumberValue() > 1000)
+            {
+                return NanThrowError("fps must be a number in (0, 1000].");
+            }
+            fps = fps_val->NumberValue();
+        }
+        if (!boundary_val->IsUndefined()) {
+            if (!boundary_val->IsString()) {
+                return NanThrowError("boundary must be a string.");
+            }
+            NanUtf8String b(boundary_val->ToString());
+            boundary = *b;
+            if (boundary.empty() || boundary.size() > MAX_BOUNDARY) {
+                return NanThrowError("boundary must be 1 to 70 characters long.");
+            }
+        }
+    }
+
+    MjpegStream *stream = new MjpegStream(source, boundary, fps);
+    NanAssignPersistent(stream->stack_obj, args[0]->ToObject());
+    stream->Wrap(args.This());
+
+    std::string content_type = "multipart/x-mixed-replace; boundary=" + boundary;
+    args.This()->Set(NanNew<String>("contentType"), NanNew<String>(content_type.c_str()));
+    NanReturnThis();
+}
+
+NAN_METHOD(MjpegStream::Start)
+{
+    NanScope();
+
+    if (args.Length() != 1 || !args[0]->IsFunction()) {
+        return NanThrowError("One argument required - callback function.");
+    }
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    if (stream->callback) {
+        return NanThrowError("MjpegStream is already started.");
+    }
+    stream->Start(new NanCallback(args[0].As<Function>()));
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(MjpegStream::Stop)
+{
+    NanScope();
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    if (stream->callback)
+        stream->Stop();
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(MjpegStream::Stats)
+{
+    NanScope();
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    Local<Object> stats = NanNew<Object>();
+    stats->Set(NanNew<String>("frames"), NanNew<Number>((double)stream->frames));
+    stats->Set(NanNew<String>("skippedIdle"), NanNew<Number>((double)stream->skipped_idle));
+    stats->Set(NanNew<String>("skippedBusy"), NanNew<Number>((double)stream->skipped_busy));
+    NanReturnValue(stats);
+}
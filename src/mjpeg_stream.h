@@ -0,0 +1,53 @@
+#ifndef MJPEG_STREAM_H
+#define MJPEG_STREAM_H
+
+#include <nan.h>
+#include <node.h>
+#include <string>
+
+#include "common.h"
+#include "frame_source.h"
+
+/*
+ * Encodes a FixedJpegStack or DynamicJpegStack at a set frame rate and hands
+ * out every frame as one part of a multipart/x-mixed-replace response, with
+ * its boundary and headers, ready to be written. A tick is skipped when the
+ * stack didn't change since the last frame, and when the last frame is still
+ * being encoded, so a slow encoder drops frames instead of queueing them.
+ */
+class MjpegStream : public node::ObjectWrap {
+    v8::Persistent<v8::Object> stack_obj; // keeps `source` alive
+    FrameSource *source;
+    std::string boundary;
+    uint64_t interval; // milliseconds between ticks
+    uv_timer_t *timer;
+
+    NanCallback *callback; // set while started
+    bool encoding;
+    bool have_generation; // last_generation is that of a frame
+    unsigned long last_generation;
+    unsigned long frames, skipped_idle, skipped_busy;
+
+    void Tick();
+
+#if UV_VERSION_MAJOR >= 1
+    static void OnTick(uv_timer_t *handle);
+#else
+    static void OnTick(uv_timer_t *handle, int status);
+#endif
+    static void UV_Encode(uv_work_t *req);
+    static void UV_EncodeAfter(uv_work_t *req);
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    MjpegStream(FrameSource *ssource, const std::string &bboundary, double fps);
+    ~MjpegStream();
+    void Start(NanCallback *cb);
+    void Stop();
+
+    static NAN_METHOD(New);
+    static NAN_METHOD(Start);
+    static NAN_METHOD(Stop);
+    static NAN_METHOD(Stats);
+};
+
+#endif
@@ -1,15 +1,30 @@
 #include <nan.h>
 #include <node.h>
 
+#include "pixel_convert.h"
+#include "compressor_cache.h"
+#include "buffer_pool.h"
+#include "encoder_pool.h"
+#include "encode_cache.h"
 #include "jpeg.h"
+#include "jpeg_decoder.h"
 #include "fixed_jpeg_stack.h"
 #include "dynamic_jpeg_stack.h"
+#include "mjpeg_stream.h"
 
 void InitAll(Handle<Object> target)
 {
+    pixel_convert_init();
+    compressor_cache_init();
+    buffer_pool_init();
+
+    EncoderPool::Initialize(target);
+    EncodeCache::Initialize(target);
     Jpeg::Initialize(target);
+    JpegDecoder::Initialize(target);
     FixedJpegStack::Initialize(target);
     DynamicJpegStack::Initialize(target);
+    MjpegStream::Initialize(target);
 }
 
 NODE_MODULE(jpeg, InitAll)
@@ -0,0 +1,740 @@
+#include "pixel_convert.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXEL_CONVERT_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXEL_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#endif
+
+/*
+ * Every kernel is instantiated from the source pixel size (3 or 4 bytes) and
+ * whether red and blue have to be swapped.
+ */
+
+template <int BPP, bool SWAP>
+static void
+scalar_to_rgb(const unsigned char *src, unsigned char *dst, int pixels)
+{
+    for (int i=0; i<pixels; i++, src+=BPP, dst+=3) {
+        dst[0] = src[SWAP ? 2 : 0];
+        dst[1] = src[1];
+        dst[2] = src[SWAP ? 0 : 2];
+    }
+}
+
+template <int BPP, bool SWAP>
+static void
+scalar_rect_to_rgb(const unsigned char *src, size_t src_stride,
+    unsigned char *dst, size_t dst_stride, int w, int h)
+{
+    for (int y = 0; y < h; y++, src += src_stride, dst += dst_stride)
+        scalar_to_rgb<BPP, SWAP>(src, dst, w);
+}
+
+/*
+ * Resampling. Weights are non-negative and add up to 1 << RESAMPLE_BITS,
+ * sums are rounded to nearest and clamped to a byte.
+ */
+
+#define RESAMPLE_ROUND (1 << (RESAMPLE_BITS - 1))
+
+static inline unsigned char
+clamp_byte(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Bytes from `start` on, the vector kernels finish their rows with it.
+static void
+resample_vertical_tail(const unsigned char **rows, const short *weights,
+    int count, unsigned char *dst, int start, int bytes)
+{
+    for (int i = start; i < bytes; i++) {
+        int sum = RESAMPLE_ROUND;
+        for (int k = 0; k < count; k++)
+            sum += weights[k]*rows[k][i];
+        dst[i] = clamp_byte(sum >> RESAMPLE_BITS);
+    }
+}
+
+static void
+scalar_resample_vertical(const unsigned char **rows, const short *weights,
+    int count, unsigned char *dst, int bytes)
+{
+    resample_vertical_tail(rows, weights, count, dst, 0, bytes);
+}
+
+template <int BPP>
+static void
+scalar_resample_horizontal(const unsigned char *src, unsigned char *dst,
+    int pixels, const int *bounds, const short *weights, int taps)
+{
+    for (int x = 0; x < pixels; x++, dst += BPP) {
+        const unsigned char *p = src + bounds[2*x]*BPP;
+        const short *w = weights + x*taps;
+        int count = bounds[2*x + 1];
+        for (int c = 0; c < BPP; c++) {
+            int sum = RESAMPLE_ROUND;
+            for (int k = 0; k < count; k++)
+                sum += w[k]*p[k*BPP + c];
+            dst[c] = clamp_byte(sum >> RESAMPLE_BITS);
+        }
+    }
+}
+
+/*
+ * Content hash, in the manner of XXH3. Every 64 bit lane of a stripe is
+ * xored with a key that depends on the stripe's position in its block, the
+ * product of the key's two 32 bit halves goes into the lane's accumulator
+ * and the plain value into its neighbour's. Scrambling the accumulators
+ * after each block makes the order of blocks matter. Only 32x32 bit
+ * multiplies are needed, which every SIMD instruction set has.
+ */
+
+#define HASH_PRIME32 0x9E3779B1U
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+// stripe s of a block uses keys s to s + 3, the scramble uses 16 to 19
+static const uint64_t hash_secret[HASH_BLOCK_STRIPES + 4] = {
+    0x2cb0f69f4abea221ULL, 0x9417034723148989ULL, 0xdd555950609dfe03ULL, 0xdbafb150deb12800ULL,
+    0x7e789b2e6c442cb6ULL, 0xf41e5636c7e4f8c4ULL, 0x0959d150f8fba7e4ULL, 0xa97316f13cdb9eeaULL,
+    0x74cd8258f9520068ULL, 0x55c74a62e116868bULL, 0xd2f4c799a2023cbdULL, 0xdf98cb79a37b51b9ULL,
+    0x396f5885524f3905ULL, 0xaf1d56386ca3b276ULL, 0xa9ffbe6b5104e85aULL, 0x6bd0c51b9fd533b3ULL,
+    0x980ce91c50ab4b56ULL, 0x28ac395780fe62c5ULL, 0x768912e3a6bcedc7ULL, 0x50b3e8c9332c7c88ULL
+};
+
+static inline void
+hash_stripe(uint64_t *acc, const unsigned char *src, const uint64_t *key)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t v;
+        memcpy(&v, src + 8*i, 8);
+        uint64_t k = v ^ key[i];
+        acc[i ^ 1] += v;
+        acc[i] += (k & 0xFFFFFFFF)*(k >> 32);
+    }
+}
+
+static inline void
+hash_scramble(uint64_t *acc)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= hash_secret[HASH_BLOCK_STRIPES + i];
+        acc[i] = a*HASH_PRIME32;
+    }
+}
+
+static void
+scalar_hash_blocks(uint64_t *acc, const unsigned char *src, size_t blocks)
+{
+    for (size_t b = 0; b < blocks; b++) {
+        for (int s = 0; s < HASH_BLOCK_STRIPES; s++, src += HASH_STRIPE)
+            hash_stripe(acc, src, hash_secret + s);
+        hash_scramble(acc);
+    }
+}
+
+static const pixel_kernels scalar_kernels = {
+    "scalar",
+    scalar_to_rgb<4, false>,
+    scalar_to_rgb<4, true>,
+    scalar_to_rgb<3, true>,
+    scalar_rect_to_rgb<4, false>,
+    scalar_rect_to_rgb<4, true>,
+    scalar_rect_to_rgb<3, true>,
+    scalar_resample_vertical,
+    scalar_resample_horizontal<3>,
+    scalar_resample_horizontal<4>,
+    scalar_hash_blocks
+};
+
+#ifdef PIXEL_CONVERT_X86
+
+// pshufb masks gathering the first four pixels of a 16 byte load into 12
+// packed RGB bytes, the last four bytes are zeroed.
+static const char shuffle_masks[2][2][16] = {
+    { // BPP == 3
+        { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, -1, -1, -1, -1 },
+        { 2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1 }
+    },
+    { // BPP == 4
+        { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 },
+        { 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 }
+    }
+};
+
+// With 3 byte pixels the last 16 byte load of a block reads 4 bytes past it,
+// so that many more pixels have to be left over for the vector loop to run.
+#define OVERREAD_PIXELS(bpp) ((bpp) == 3 ? 2 : 0)
+
+// Stores the 12 bytes of 4 pixels shuffled to the bottom of `a`.
+TARGET_SSSE3 static inline void
+store_rgb4(unsigned char *dst, __m128i a)
+{
+    int last = _mm_cvtsi128_si32(_mm_srli_si128(a, 8));
+    _mm_storel_epi64((__m128i *)dst, a);
+    memcpy(dst + 8, &last, 4);
+}
+
+// The end of a row, 4 pixels at a time storing exactly their 12 bytes, then
+// the last few one by one. Narrow pushes are mostly tail, so this matters.
+template <int BPP, bool SWAP>
+TARGET_SSSE3 static inline void
+ssse3_tail_to_rgb(const unsigned char *src, unsigned char *dst, int pixels,
+    __m128i mask)
+{
+    int i = 0;
+    for (; i + 4 + OVERREAD_PIXELS(BPP) <= pixels; i += 4) {
+        store_rgb4(dst, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), mask));
+
+        src += 4*BPP;
+        dst += 12;
+    }
+    scalar_to_rgb<BPP, SWAP>(src, dst, pixels - i);
+}
+
+template <int BPP, bool SWAP>
+TARGET_SSSE3 static void
+ssse3_to_rgb(const unsigned char *src, unsigned char *dst, int pixels)
+{
+    const __m128i mask = _mm_loadu_si128((const __m128i *)shuffle_masks[BPP == 4][SWAP]);
+
+    int i = 0;
+    for (; i + 16 + OVERREAD_PIXELS(BPP) <= pixels; i += 16) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), mask);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 4*BPP)), mask);
+        __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 8*BPP)), mask);
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 12*BPP)), mask);
+
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128((__m128i *)(dst + 16),
+            _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+        _mm_storeu_si128((__m128i *)(dst + 32),
+            _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+
+        src += 16*BPP;
+        dst += 48;
+    }
+    ssse3_tail_to_rgb<BPP, SWAP>(src, dst, pixels - i, mask);
+}
+
+// Narrow rects, where a row is a few vector steps and a tail. Rows are done
+// 4 pixels at a time with no call or scalar tail per row. Every group but a
+// row's first is loaded from the 16 bytes ending with it, so nothing past
+// the row is read, and the last group of a row overlaps the one before it
+// when the width isn't a multiple of 4.
+template <int BPP, bool SWAP>
+TARGET_SSSE3 static void
+ssse3_rect_to_rgb(const unsigned char *src, size_t src_stride,
+    unsigned char *dst, size_t dst_stride, int w, int h)
+{
+    if (w*BPP < 16) {
+        for (int y = 0; y < h; y++, src += src_stride, dst += dst_stride)
+            scalar_to_rgb<BPP, SWAP>(src, dst, w);
+        return;
+    }
+
+    const __m128i mask = _mm_loadu_si128((const __m128i *)shuffle_masks[BPP == 4][SWAP]);
+    // the same pixels at the top of the 16 bytes, the unused lanes don't matter
+    const __m128i end_mask = _mm_add_epi8(mask, _mm_set1_epi8(16 - 4*BPP));
+
+    for (int y = 0; y < h; y++, src += src_stride, dst += dst_stride) {
+        store_rgb4(dst, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), mask));
+        for (int i = 4; i + 4 < w; i += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(src + (i + 4)*BPP - 16));
+            store_rgb4(dst + i*3, _mm_shuffle_epi8(a, end_mask));
+        }
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + w*BPP - 16));
+        store_rgb4(dst + (w - 4)*3, _mm_shuffle_epi8(a, end_mask));
+    }
+}
+
+/*
+ * The SSE resamplers take two rows (or pixels) per step: their bytes are
+ * interleaved into 16 bit pairs and pmaddwd multiplies each pair with the
+ * two weights and adds them up. Only SSE2 is needed, they are grouped with
+ * the SSSE3 swizzles as every CPU with SSSE3 has SSE2.
+ */
+
+// Two weights packed the way pmaddwd pairs them with interleaved values.
+static inline int
+weight_pair(const short *weights, int k, int count)
+{
+    int w1 = k + 1 < count ? weights[k + 1] : 0;
+    return (unsigned short)weights[k] | (w1 << 16);
+}
+
+TARGET_SSSE3 static void
+sse2_resample_vertical(const unsigned char **rows, const short *weights,
+    int count, unsigned char *dst, int bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        __m128i lo = _mm_set1_epi32(RESAMPLE_ROUND);
+        __m128i hi = lo;
+        for (int k = 0; k < count; k += 2) {
+            __m128i w = _mm_set1_epi32(weight_pair(weights, k, count));
+            __m128i a = _mm_loadl_epi64((const __m128i *)(rows[k] + i));
+            __m128i b = k + 1 < count ?
+                _mm_loadl_epi64((const __m128i *)(rows[k + 1] + i)) : zero;
+            __m128i ab = _mm_unpacklo_epi8(a, b);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi8(ab, zero), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi8(ab, zero), w));
+        }
+        lo = _mm_srai_epi32(lo, RESAMPLE_BITS);
+        hi = _mm_srai_epi32(hi, RESAMPLE_BITS);
+        __m128i packed = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(packed, packed));
+    }
+
+    resample_vertical_tail(rows, weights, count, dst, i, bytes);
+}
+
+template <int BPP>
+TARGET_SSSE3 static void
+sse2_resample_horizontal(const unsigned char *src, unsigned char *dst,
+    int pixels, const int *bounds, const short *weights, int taps)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int x = 0; x < pixels; x++, dst += BPP) {
+        const unsigned char *p = src + bounds[2*x]*BPP;
+        const short *w = weights + x*taps;
+        int count = bounds[2*x + 1];
+
+        // 4 byte loads, with 3 byte pixels the 4th byte is ignored
+        __m128i sum = _mm_set1_epi32(RESAMPLE_ROUND);
+        for (int k = 0; k < count; k += 2) {
+            int pa, pb = 0;
+            memcpy(&pa, p + k*BPP, 4);
+            if (k + 1 < count)
+                memcpy(&pb, p + (k + 1)*BPP, 4);
+            __m128i ab = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pa), _mm_cvtsi32_si128(pb));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(ab, zero),
+                _mm_set1_epi32(weight_pair(w, k, count))));
+        }
+        sum = _mm_srai_epi32(sum, RESAMPLE_BITS);
+        sum = _mm_packs_epi32(sum, sum);
+        int out = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+        memcpy(dst, &out, BPP);
+    }
+}
+
+// Two lanes per register. pshufd swaps the 64 bit halves for the values
+// that go into the neighbouring lane.
+TARGET_SSSE3 static inline __m128i
+sse2_hash_lanes(__m128i acc, __m128i v, const uint64_t *key)
+{
+    __m128i k = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)key));
+    __m128i product = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+    acc = _mm_add_epi64(acc, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_add_epi64(acc, product);
+}
+
+// a*HASH_PRIME32 from two 32x32 bit multiplies
+TARGET_SSSE3 static inline __m128i
+sse2_hash_scramble(__m128i a, const uint64_t *key)
+{
+    const __m128i prime = _mm_set1_epi32(HASH_PRIME32);
+    a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+    a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)key));
+    __m128i lo = _mm_mul_epu32(a, prime);
+    __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+    return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+TARGET_SSSE3 static void
+sse2_hash_blocks(uint64_t *acc, const unsigned char *src, size_t blocks)
+{
+    __m128i a0 = _mm_loadu_si128((const __m128i *)acc);
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(acc + 2));
+
+    for (size_t b = 0; b < blocks; b++) {
+        for (int s = 0; s < HASH_BLOCK_STRIPES; s++, src += HASH_STRIPE) {
+            a0 = sse2_hash_lanes(a0, _mm_loadu_si128((const __m128i *)src),
+                hash_secret + s);
+            a1 = sse2_hash_lanes(a1, _mm_loadu_si128((const __m128i *)(src + 16)),
+                hash_secret + s + 2);
+        }
+        a0 = sse2_hash_scramble(a0, hash_secret + HASH_BLOCK_STRIPES);
+        a1 = sse2_hash_scramble(a1, hash_secret + HASH_BLOCK_STRIPES + 2);
+    }
+
+    _mm_storeu_si128((__m128i *)acc, a0);
+    _mm_storeu_si128((__m128i *)(acc + 2), a1);
+}
+
+static const pixel_kernels ssse3_kernels = {
+    "ssse3",
+    ssse3_to_rgb<4, false>,
+    ssse3_to_rgb<4, true>,
+    ssse3_to_rgb<3, true>,
+    ssse3_rect_to_rgb<4, false>,
+    ssse3_rect_to_rgb<4, true>,
+    ssse3_rect_to_rgb<3, true>,
+    sse2_resample_vertical,
+    sse2_resample_horizontal<3>,
+    sse2_resample_horizontal<4>,
+    sse2_hash_blocks
+};
+
+template <int BPP, bool SWAP>
+TARGET_AVX2 static void
+avx2_to_rgb(const unsigned char *src, unsigned char *dst, int pixels)
+{
+    const __m128i mask128 = _mm_loadu_si128((const __m128i *)shuffle_masks[BPP == 4][SWAP]);
+    const __m256i mask = _mm256_inserti128_si256(_mm256_castsi128_si256(mask128), mask128, 1);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    // Each step stores 32 bytes of which only the first 24 are valid. The
+    // 8 garbage bytes land on the next 3 pixels of this same row, which the
+    // following step (or the scalar tail) overwrites, so 3 pixels must remain.
+    int i = 0;
+    for (; i + 8 + 3 <= pixels; i += 8) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+            _mm_loadu_si128((const __m128i *)(src + 4*BPP)), 1);
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), pack);
+        _mm256_storeu_si256((__m256i *)dst, v);
+
+        src += 8*BPP;
+        dst += 24;
+    }
+    ssse3_tail_to_rgb<BPP, SWAP>(src, dst, pixels - i, mask128);
+}
+
+// Same as the SSE2 version on 16 bytes at a time. The 256 bit unpacks and
+// packs work within 128 bit lanes, the final permute moves the low 8 bytes
+// of both lanes next to each other.
+TARGET_AVX2 static void
+avx2_resample_vertical(const unsigned char **rows, const short *weights,
+    int count, unsigned char *dst, int bytes)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m256i lo = _mm256_set1_epi32(RESAMPLE_ROUND);
+        __m256i hi = lo;
+        for (int k = 0; k < count; k += 2) {
+            __m256i w = _mm256_set1_epi32(weight_pair(weights, k, count));
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k] + i)));
+            __m256i b = k + 1 < count ? _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(rows[k + 1] + i))) : zero;
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        lo = _mm256_srai_epi32(lo, RESAMPLE_BITS);
+        hi = _mm256_srai_epi32(hi, RESAMPLE_BITS);
+        __m256i packed = _mm256_packs_epi32(lo, hi);
+        packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(packed, packed), 0xD8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_castsi256_si128(packed));
+    }
+    resample_vertical_tail(rows, weights, count, dst, i, bytes);
+}
+
+// The SSE2 hash with all four lanes in one register, a stripe per load.
+TARGET_AVX2 static void
+avx2_hash_blocks(uint64_t *acc, const unsigned char *src, size_t blocks)
+{
+    const __m256i prime = _mm256_set1_epi32(HASH_PRIME32);
+    __m256i a = _mm256_loadu_si256((const __m256i *)acc);
+
+    for (size_t b = 0; b < blocks; b++) {
+        for (int s = 0; s < HASH_BLOCK_STRIPES; s++, src += HASH_STRIPE) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)src);
+            __m256i k = _mm256_xor_si256(v,
+                _mm256_loadu_si256((const __m256i *)(hash_secret + s)));
+            __m256i product = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+            a = _mm256_add_epi64(a, _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+            a = _mm256_add_epi64(a, product);
+        }
+        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+        a = _mm256_xor_si256(a,
+            _mm256_loadu_si256((const __m256i *)(hash_secret + HASH_BLOCK_STRIPES)));
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+        a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+
+    _mm256_storeu_si256((__m256i *)acc, a);
+}
+
+static const pixel_kernels avx2_kernels = {
+    "avx2",
+    avx2_to_rgb<4, false>,
+    avx2_to_rgb<4, true>,
+    avx2_to_rgb<3, true>,
+    ssse3_rect_to_rgb<4, false>,
+    ssse3_rect_to_rgb<4, true>,
+    ssse3_rect_to_rgb<3, true>,
+    avx2_resample_vertical,
+    sse2_resample_horizontal<3>,
+    sse2_resample_horizontal<4>,
+    avx2_hash_blocks
+};
+
+static bool
+cpu_has_ssse3()
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return false;
+#endif
+}
+
+static bool
+cpu_has_avx2()
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+#endif // PIXEL_CONVERT_X86
+
+#ifdef PIXEL_CONVERT_NEON
+
+template <int BPP, bool SWAP>
+static void
+neon_to_rgb(const unsigned char *src, unsigned char *dst, int pixels)
+{
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x16x3_t out;
+        if (BPP == 4) {
+            uint8x16x4_t in = vld4q_u8(src);
+            out.val[0] = in.val[SWAP ? 2 : 0];
+            out.val[1] = in.val[1];
+            out.val[2] = in.val[SWAP ? 0 : 2];
+        }
+        else {
+            uint8x16x3_t in = vld3q_u8(src);
+            out.val[0] = in.val[SWAP ? 2 : 0];
+            out.val[1] = in.val[1];
+            out.val[2] = in.val[SWAP ? 0 : 2];
+        }
+        vst3q_u8(dst, out);
+
+        src += 16*BPP;
+        dst += 48;
+    }
+    scalar_to_rgb<BPP, SWAP>(src, dst, pixels - i);
+}
+
+template <int BPP, bool SWAP>
+static void
+neon_rect_to_rgb(const unsigned char *src, size_t src_stride,
+    unsigned char *dst, size_t dst_stride, int w, int h)
+{
+    for (int y = 0; y < h; y++, src += src_stride, dst += dst_stride)
+        neon_to_rgb<BPP, SWAP>(src, dst, w);
+}
+
+static void
+neon_resample_vertical(const unsigned char **rows, const short *weights,
+    int count, unsigned char *dst, int bytes)
+{
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        int32x4_t lo = vdupq_n_s32(RESAMPLE_ROUND);
+        int32x4_t hi = lo;
+        for (int k = 0; k < count; k++) {
+            int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + i)));
+            lo = vmlal_n_s16(lo, vget_low_s16(v), weights[k]);
+            hi = vmlal_n_s16(hi, vget_high_s16(v), weights[k]);
+        }
+        int16x8_t packed = vcombine_s16(vqshrn_n_s32(lo, RESAMPLE_BITS),
+                                        vqshrn_n_s32(hi, RESAMPLE_BITS));
+        vst1_u8(dst + i, vqmovun_s16(packed));
+    }
+    resample_vertical_tail(rows, weights, count, dst, i, bytes);
+}
+
+static inline uint64x2_t
+neon_hash_lanes(uint64x2_t acc, uint64x2_t v, const uint64_t *key)
+{
+    uint64x2_t k = veorq_u64(v, vld1q_u64(key));
+    acc = vaddq_u64(acc, vextq_u64(v, v, 1));
+    return vmlal_u32(acc, vmovn_u64(k), vshrn_n_u64(k, 32));
+}
+
+static inline uint64x2_t
+neon_hash_scramble(uint64x2_t a, const uint64_t *key)
+{
+    const uint32x2_t prime = vdup_n_u32(HASH_PRIME32);
+    a = veorq_u64(a, vshrq_n_u64(a, 47));
+    a = veorq_u64(a, vld1q_u64(key));
+    uint64x2_t hi = vmull_u32(vshrn_n_u64(a, 32), prime);
+    return vmlal_u32(vshlq_n_u64(hi, 32), vmovn_u64(a), prime);
+}
+
+static void
+neon_hash_blocks(uint64_t *acc, const unsigned char *src, size_t blocks)
+{
+    uint64x2_t a0 = vld1q_u64(acc);
+    uint64x2_t a1 = vld1q_u64(acc + 2);
+
+    for (size_t b = 0; b < blocks; b++) {
+        for (int s = 0; s < HASH_BLOCK_STRIPES; s++, src += HASH_STRIPE) {
+            a0 = neon_hash_lanes(a0, vreinterpretq_u64_u8(vld1q_u8(src)),
+                hash_secret + s);
+            a1 = neon_hash_lanes(a1, vreinterpretq_u64_u8(vld1q_u8(src + 16)),
+                hash_secret + s + 2);
+        }
+        a0 = neon_hash_scramble(a0, hash_secret + HASH_BLOCK_STRIPES);
+        a1 = neon_hash_scramble(a1, hash_secret + HASH_BLOCK_STRIPES + 2);
+    }
+
+    vst1q_u64(acc, a0);
+    vst1q_u64(acc + 2, a1);
+}
+
+static const pixel_kernels neon_kernels = {
+    "neon",
+    neon_to_rgb<4, false>,
+    neon_to_rgb<4, true>,
+    neon_to_rgb<3, true>,
+    neon_rect_to_rgb<4, false>,
+    neon_rect_to_rgb<4, true>,
+    neon_rect_to_rgb<3, true>,
+    neon_resample_vertical,
+    scalar_resample_horizontal<3>,
+    scalar_resample_horizontal<4>,
+    neon_hash_blocks
+};
+
+#endif // PIXEL_CONVERT_NEON
+
+static const pixel_kernels *active_kernels = &scalar_kernels;
+
+int
+pixel_kernels_available(const pixel_kernels **list, int max)
+{
+    int n = 0;
+    if (n < max) list[n++] = &scalar_kernels;
+#ifdef PIXEL_CONVERT_X86
+    if (n < max && cpu_has_ssse3()) list[n++] = &ssse3_kernels;
+    if (n < max && cpu_has_avx2()) list[n++] = &avx2_kernels;
+#endif
+#ifdef PIXEL_CONVERT_NEON
+    if (n < max) list[n++] = &neon_kernels;
+#endif
+    return n;
+}
+
+void
+pixel_convert_init()
+{
+    const pixel_kernels *list[4];
+    int n = pixel_kernels_available(list, 4);
+    active_kernels = list[n-1];
+}
+
+const pixel_kernels *
+pixel_kernels_active()
+{
+    return active_kernels;
+}
+
+void
+rgba_to_rgb_row(const unsigned char *rgba, unsigned char *rgb, int pixels)
+{
+    active_kernels->rgba_to_rgb(rgba, rgb, pixels);
+}
+
+void
+bgra_to_rgb_row(const unsigned char *bgra, unsigned char *rgb, int pixels)
+{
+    active_kernels->bgra_to_rgb(bgra, rgb, pixels);
+}
+
+void
+bgr_to_rgb_row(const unsigned char *bgr, unsigned char *rgb, int pixels)
+{
+    active_kernels->bgr_to_rgb(bgr, rgb, pixels);
+}
+
+uint64_t
+pixel_hash_with(const pixel_kernels *kernels, const unsigned char *data,
+    size_t len)
+{
+    uint64_t acc[4] = {
+        HASH_PRIME64_1, HASH_PRIME64_2, ~HASH_PRIME64_1, ~HASH_PRIME64_2
+    };
+
+    size_t blocks = len/HASH_BLOCK;
+    kernels->hash_blocks(acc, data, blocks);
+    data += blocks*HASH_BLOCK;
+    size_t rest = len - blocks*HASH_BLOCK;
+
+    // what's left of the last block, its last stripe padded with zeros
+    int s = 0;
+    for (; rest >= HASH_STRIPE; s++, rest -= HASH_STRIPE, data += HASH_STRIPE)
+        hash_stripe(acc, data, hash_secret + s);
+    if (rest) {
+        unsigned char last[HASH_STRIPE] = { 0 };
+        memcpy(last, data, rest);
+        hash_stripe(acc, last, hash_secret + s);
+    }
+
+    uint64_t h = len*HASH_PRIME64_1;
+    for (int i = 0; i < 4; i++) {
+        h ^= acc[i]*HASH_PRIME64_2;
+        h = ((h << 31) | (h >> 33))*HASH_PRIME64_1;
+    }
+
+    // murmur3's finalizer
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t
+pixel_hash(const unsigned char *data, size_t len)
+{
+    return pixel_hash_with(active_kernels, data, len);
+}
+
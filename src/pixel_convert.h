@@ -0,0 +1,76 @@
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+#include <cstddef>
+#include <stdint.h>
+
+// pixel layout of the buffers handed to Jpeg and the stacks
+typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA } buffer_type;
+
+// convert a single row of `pixels` pixels into packed RGB
+typedef void (*row_converter)(const unsigned char *src, unsigned char *dst, int pixels);
+
+// convert a w x h rect whose rows don't follow each other, for narrow ones
+typedef void (*rect_converter)(const unsigned char *src, size_t src_stride,
+    unsigned char *dst, size_t dst_stride, int w, int h);
+
+// Resampling weights are fixed point with this many fractional bits.
+#define RESAMPLE_BITS 14
+
+// dst[i] = sum of weights[k]*rows[k][i] over `count` rows, for `bytes` bytes
+typedef void (*vertical_resampler)(const unsigned char **rows,
+    const short *weights, int count, unsigned char *dst, int bytes);
+
+// Output pixel x is the sum of weights[x*taps + k]*src[bounds[2*x] + k] over
+// bounds[2*x + 1] source pixels. May read a byte past the source row.
+typedef void (*horizontal_resampler)(const unsigned char *src,
+    unsigned char *dst, int pixels, const int *bounds, const short *weights,
+    int taps);
+
+// The content hash works on 32 byte stripes of four 64 bit lanes, in blocks
+// of HASH_BLOCK_STRIPES stripes after each of which the lanes are scrambled.
+#define HASH_STRIPE 32
+#define HASH_BLOCK_STRIPES 16
+#define HASH_BLOCK (HASH_STRIPE*HASH_BLOCK_STRIPES)
+
+// Runs `blocks` whole blocks of `src` through the 4 accumulator lanes.
+typedef void (*hash_accumulator)(uint64_t *acc, const unsigned char *src,
+    size_t blocks);
+
+// One implementation of every supported swizzle for a given instruction set.
+struct pixel_kernels {
+    const char *name;
+    row_converter rgba_to_rgb;
+    row_converter bgra_to_rgb;
+    row_converter bgr_to_rgb;
+    rect_converter rgba_to_rgb_rect;
+    rect_converter bgra_to_rgb_rect;
+    rect_converter bgr_to_rgb_rect;
+    vertical_resampler resample_vertical;
+    horizontal_resampler resample_horizontal3; // 3 byte pixels
+    horizontal_resampler resample_horizontal4; // 4 byte pixels
+    hash_accumulator hash_blocks;
+};
+
+// Picks the fastest kernels the CPU supports. Called once at module load,
+// the scalar kernels are used until then.
+void pixel_convert_init();
+const pixel_kernels *pixel_kernels_active();
+
+// Fills `list` with every kernel set usable on this CPU, scalar first.
+// Returns the number of entries written.
+int pixel_kernels_available(const pixel_kernels **list, int max);
+
+// converters using the active kernels
+void rgba_to_rgb_row(const unsigned char *rgba, unsigned char *rgb, int pixels);
+void bgra_to_rgb_row(const unsigned char *bgra, unsigned char *rgb, int pixels);
+void bgr_to_rgb_row(const unsigned char *bgr, unsigned char *rgb, int pixels);
+
+// Fast non-cryptographic 64 bit hash of `len` bytes, the same with every
+// kernel set. Used to recognize pixels that were encoded before.
+uint64_t pixel_hash(const unsigned char *data, size_t len);
+uint64_t pixel_hash_with(const pixel_kernels *kernels,
+    const unsigned char *data, size_t len);
+
+#endif
+
@@ -0,0 +1,184 @@
+#include "resizer.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+void
+resize_dimensions(int src_w, int src_h, int target_w, int target_h,
+    int *w, int *h)
+{
+    *w = src_w;
+    *h = src_h;
+    if (target_w && target_h) {
+        *w = target_w;
+        *h = target_h;
+    }
+    else if (target_w && src_w) {
+        *w = target_w;
+        *h = (int)((double)src_h*target_w/src_w + 0.5);
+        if (*h < 1 && src_h) *h = 1;
+    }
+    else if (target_h && src_h) {
+        *h = target_h;
+        *w = (int)((double)src_w*target_h/src_h + 0.5);
+        if (*w < 1 && src_w) *w = 1;
+    }
+}
+
+static double
+box_filter(double x)
+{
+    return x > -0.5 && x <= 0.5 ? 1.0 : 0.0;
+}
+
+static double
+triangle_filter(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+/*
+ * Taps of every output pixel along one axis. The filter is stretched by the
+ * scale when shrinking so that every source pixel contributes, box then
+ * averages the area an output pixel covers. The weights of each pixel are
+ * rounded to fixed point so that they still add up to exactly one.
+ */
+static int
+compute_weights(int in, int out, resize_filter filter, int **bounds_out,
+    short **weights_out)
+{
+    double (*f)(double) = filter == RESIZE_BOX ? box_filter : triangle_filter;
+    double scale = (double)in/out;
+    double filter_scale = scale < 1.0 ? 1.0 : scale;
+    double support = (filter == RESIZE_BOX ? 0.5 : 1.0)*filter_scale;
+    int taps = 2*(int)ceil(support) + 1;
+
+    int *bounds = (int *)malloc(2*out*sizeof(int));
+    short *weights = (short *)calloc((size_t)out*taps, sizeof(short));
+    double *w = (double *)malloc(taps*sizeof(double));
+    if (!bounds || !weights || !w) {
+        free(bounds);
+        free(weights);
+        free(w);
+        throw "malloc failed in Resizer::setup.";
+    }
+
+    for (int x = 0; x < out; x++) {
+        double center = (x + 0.5)*scale;
+        int start = (int)(center - support + 0.5);
+        int end = (int)(center + support + 0.5);
+        if (start < 0) start = 0;
+        if (end > in) end = in;
+        int count = end - start;
+        if (count > taps) count = taps;
+
+        double total = 0;
+        for (int k = 0; k < count; k++) {
+            w[k] = f((start + k - center + 0.5)/filter_scale);
+            total += w[k];
+        }
+
+        short *fixed = weights + x*taps;
+        int sum = 0, largest = 0;
+        for (int k = 0; k < count; k++) {
+            fixed[k] = total > 0 ?
+                (short)floor(w[k]/total*(1 << RESAMPLE_BITS) + 0.5) : 0;
+            sum += fixed[k];
+            if (fixed[k] > fixed[largest]) largest = k;
+        }
+        if (count == 0) {
+            // pixel center outside the source, only for degenerate sizes
+            start = center < in ? (int)center : in - 1;
+            count = 1;
+        }
+        fixed[largest] += (1 << RESAMPLE_BITS) - sum;
+
+        // taps that round to nothing are skipped
+        int skip = 0;
+        while (skip < count - 1 && fixed[skip] == 0) skip++;
+        if (skip) memmove(fixed, fixed + skip, (count - skip)*sizeof(short));
+        count -= skip;
+        while (count > 1 && fixed[count - 1] == 0) count--;
+
+        bounds[2*x] = start + skip;
+        bounds[2*x + 1] = count;
+    }
+
+    free(w);
+    *bounds_out = bounds;
+    *weights_out = weights;
+    return taps;
+}
+
+Resizer::Resizer() :
+    src_w(0), src_h(0), dst_w(0), dst_h(0), bpp(0),
+    x_bounds(NULL), y_bounds(NULL), x_weights(NULL), y_weights(NULL),
+    x_taps(0), y_taps(0), blended(NULL) {}
+
+Resizer::~Resizer()
+{
+    free(x_bounds);
+    free(y_bounds);
+    free(x_weights);
+    free(y_weights);
+    free(blended);
+}
+
+void
+Resizer::setup(int ssrc_w, int ssrc_h, int ddst_w, int ddst_h, int bbpp,
+    resize_filter filter)
+{
+    src_w = ssrc_w;
+    src_h = ssrc_h;
+    dst_w = ddst_w;
+    dst_h = ddst_h;
+    bpp = bbpp;
+    if (!active())
+        return;
+
+    x_taps = compute_weights(src_w, dst_w, filter, &x_bounds, &x_weights);
+    y_taps = compute_weights(src_h, dst_h, filter, &y_bounds, &y_weights);
+
+    // padded for the horizontal resamplers reading past the row
+    blended = (unsigned char *)malloc((size_t)src_w*bpp + 4);
+    if (!blended)
+        throw "malloc failed in Resizer::setup.";
+}
+
+bool
+Resizer::active() const
+{
+    return src_w > 0 && src_h > 0 && dst_w > 0 && dst_h > 0 &&
+        (src_w != dst_w || src_h != dst_h);
+}
+
+void
+Resizer::source_rows(int y, int *first, int *count) const
+{
+    *first = y_bounds[2*y];
+    *count = y_bounds[2*y + 1];
+}
+
+int
+Resizer::max_rows() const
+{
+    return y_taps;
+}
+
+void
+Resizer::row(const unsigned char **rows, int y, unsigned char *out)
+{
+    const pixel_kernels *kernels = pixel_kernels_active();
+    int count = y_bounds[2*y + 1];
+
+    if (src_w == dst_w) {
+        kernels->resample_vertical(rows, y_weights + y*y_taps, count, out, src_w*bpp);
+        return;
+    }
+
+    kernels->resample_vertical(rows, y_weights + y*y_taps, count, blended, src_w*bpp);
+    horizontal_resampler horizontal = bpp == 4 ?
+        kernels->resample_horizontal4 : kernels->resample_horizontal3;
+    horizontal(blended, out, dst_w, x_bounds, x_weights, x_taps);
+}
@@ -0,0 +1,42 @@
+#ifndef RESIZER_H
+#define RESIZER_H
+
+#include "pixel_convert.h"
+
+typedef enum { RESIZE_BOX, RESIZE_BILINEAR } resize_filter;
+
+// Size an image of src_w x src_h gets resized to. A target of 0 follows
+// the other one keeping the aspect ratio, both 0 keeps the size.
+void resize_dimensions(int src_w, int src_h, int target_w, int target_h,
+    int *w, int *h);
+
+/*
+ * Resizes an image one output row at a time, for feeding libjpeg without
+ * a full size copy of the image. Every row first blends the source rows it
+ * covers into one full width row, which is then resampled horizontally.
+ * Both passes use the resamplers of the active pixel kernels.
+ */
+class Resizer {
+    int src_w, src_h, dst_w, dst_h, bpp;
+    int *x_bounds, *y_bounds;    // start and count of the taps of each pixel
+    short *x_weights, *y_weights;
+    int x_taps, y_taps;          // weights per pixel
+    unsigned char *blended;      // the vertical pass' row
+
+public:
+    Resizer();
+    ~Resizer();
+
+    void setup(int ssrc_w, int ssrc_h, int ddst_w, int ddst_h, int bbpp,
+        resize_filter filter);
+    bool active() const;
+
+    // The source rows output row `y` is made from, at most max_rows().
+    void source_rows(int y, int *first, int *count) const;
+    int max_rows() const;
+
+    // Writes output row `y` to `out`, from the rows source_rows() named.
+    void row(const unsigned char **rows, int y, unsigned char *out);
+};
+
+#endif
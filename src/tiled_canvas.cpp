@@ -0,0 +1,163 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "tiled_canvas.h"
+#include "blit.h"
+
+TileView::TileView(const Rect &ggrid, const unsigned char *ccolor) :
+    grid(ggrid), tiles((size_t)ggrid.w*ggrid.h, (canvas_tile *)NULL)
+{
+    memcpy(color, ccolor, 3);
+}
+
+TileView::~TileView()
+{
+    for (size_t i = 0; i < tiles.size(); i++) {
+        if (tiles[i] && --tiles[i]->refs == 0)
+            free(tiles[i]);
+    }
+}
+
+const unsigned char *
+TileView::row(int y, int x, int w, unsigned char *scratch) const
+{
+    int in_y = y%TILE_SIZE;
+    const canvas_tile * const *tile_row =
+        &tiles[(size_t)(y/TILE_SIZE - grid.y)*grid.w];
+
+    // rows that don't leave their tile are read from it in place
+    int tx = x/TILE_SIZE - grid.x, in_x = x%TILE_SIZE;
+    if (in_x + w <= TILE_SIZE && tile_row[tx])
+        return tile_row[tx]->pixels + (in_y*TILE_SIZE + in_x)*3;
+
+    unsigned char *dst = scratch;
+    while (w > 0) {
+        int n = TILE_SIZE - in_x;
+        if (n > w) n = w;
+        const canvas_tile *tile = tile_row[tx];
+        if (tile)
+            memcpy(dst, tile->pixels + (in_y*TILE_SIZE + in_x)*3, n*3);
+        else
+            fill_rgb(dst, n, color);
+        dst += n*3;
+        w -= n;
+        tx++;
+        in_x = 0;
+    }
+    return scratch;
+}
+
+TiledCanvas::TiledCanvas(int width, int height, const unsigned char *color) :
+    view(Rect(0, 0, (width + TILE_SIZE - 1)/TILE_SIZE,
+        (height + TILE_SIZE - 1)/TILE_SIZE), color) {}
+
+// Tile (tx, ty) for writing: allocated if it wasn't, copied if a snapshot
+// shares it.
+canvas_tile *
+TiledCanvas::writable_tile(int tx, int ty)
+{
+    canvas_tile *&tile = view.tiles[(size_t)ty*view.grid.w + tx];
+    if (tile && tile->refs == 1)
+        return tile;
+
+    canvas_tile *fresh = (canvas_tile *)malloc(sizeof(*fresh));
+    if (!fresh) throw "malloc failed in TiledCanvas::write.";
+    fresh->refs = 1;
+    if (tile) {
+        memcpy(fresh->pixels, tile->pixels, sizeof(fresh->pixels));
+        tile->refs--;
+    }
+    else {
+        fill_rgb(fresh->pixels, TILE_SIZE*TILE_SIZE, view.color);
+    }
+    tile = fresh;
+    return tile;
+}
+
+// Copies a w x h image in `buf_type` to (x, y), which must be inside.
+void
+TiledCanvas::write(const unsigned char *data, int x, int y, int w, int h,
+    buffer_type buf_type)
+{
+    std::vector<blit_op> ops;
+    prepare_write(data, x, y, w, h, buf_type, &ops);
+    for (size_t i = 0; i < ops.size(); i++) {
+        const blit_op &op = ops[i];
+        blit_rgb(op.dst, op.dst_stride, op.src, op.src_stride, op.w, op.h,
+            buf_type);
+    }
+}
+
+// Makes the tiles under a write writable and appends the blits of the write
+// to `ops`, to be run later, possibly on another thread.
+void
+TiledCanvas::prepare_write(const unsigned char *data, int x, int y, int w,
+    int h, buffer_type buf_type, std::vector<blit_op> *ops)
+{
+    int bpp = bytes_per_pixel(buf_type);
+
+    for (int ty = y/TILE_SIZE; ty*TILE_SIZE < y + h; ty++) {
+        int y0 = ty*TILE_SIZE > y ? ty*TILE_SIZE : y;
+        int y1 = (ty + 1)*TILE_SIZE < y + h ? (ty + 1)*TILE_SIZE : y + h;
+
+        for (int tx = x/TILE_SIZE; tx*TILE_SIZE < x + w; tx++) {
+            int x0 = tx*TILE_SIZE > x ? tx*TILE_SIZE : x;
+            int x1 = (tx + 1)*TILE_SIZE < x + w ? (tx + 1)*TILE_SIZE : x + w;
+
+            canvas_tile *tile = writable_tile(tx, ty);
+            blit_op op;
+            op.dst = tile->pixels + ((y0 - ty*TILE_SIZE)*TILE_SIZE + x0 - tx*TILE_SIZE)*3;
+            op.dst_stride = TILE_SIZE*3;
+            op.src = data + ((size_t)(y0 - y)*w + x0 - x)*bpp;
+            op.src_stride = (size_t)w*bpp;
+            op.w = x1 - x0;
+            op.h = y1 - y0;
+            ops->push_back(op);
+        }
+    }
+}
+
+// true if a write to the rect would copy tiles a snapshot holds.
+bool
+TiledCanvas::shared(int x, int y, int w, int h) const
+{
+    for (int ty = y/TILE_SIZE; ty*TILE_SIZE < y + h; ty++) {
+        for (int tx = x/TILE_SIZE; tx*TILE_SIZE < x + w; tx++) {
+            const canvas_tile *tile = view.tiles[(size_t)ty*view.grid.w + tx];
+            if (tile && tile->refs > 1)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Rows of the canvas as it is, for encodes on the main thread.
+const RowProvider *
+TiledCanvas::rows() const
+{
+    return &view;
+}
+
+// The tiles under pixel rect `r` as they are now, for an async encode.
+TileView *
+TiledCanvas::snapshot(const Rect &r) const
+{
+    Rect grid(0, 0, 0, 0);
+    if (r.w > 0 && r.h > 0) {
+        grid.x = r.x/TILE_SIZE;
+        grid.y = r.y/TILE_SIZE;
+        grid.w = (r.x + r.w - 1)/TILE_SIZE - grid.x + 1;
+        grid.h = (r.y + r.h - 1)/TILE_SIZE - grid.y + 1;
+    }
+
+    TileView *snap = new TileView(grid, view.color);
+    for (int ty = 0; ty < grid.h; ty++) {
+        for (int tx = 0; tx < grid.w; tx++) {
+            canvas_tile *tile = view.tiles[(size_t)(grid.y + ty)*view.grid.w + grid.x + tx];
+            if (tile)
+                tile->refs++;
+            snap->tiles[(size_t)ty*grid.w + tx] = tile;
+        }
+    }
+    return snap;
+}
@@ -0,0 +1,61 @@
+#ifndef TILED_CANVAS_H
+#define TILED_CANVAS_H
+
+#include <vector>
+#include "common.h"
+#include "jpeg_encoder.h"
+#include "blit.h"
+
+// Tiles are TILE_SIZE x TILE_SIZE RGB pixels.
+#define TILE_SIZE 64
+
+struct canvas_tile {
+    int refs; // canvas and snapshots holding the tile
+    unsigned char pixels[TILE_SIZE*TILE_SIZE*3];
+};
+
+/*
+ * A grid of tiles of a canvas, read by encoders as rows. Tiles that were
+ * never written hold the background color and aren't allocated.
+ */
+class TileView : public RowProvider {
+    friend class TiledCanvas;
+
+    Rect grid; // the tiles held, in tiles
+    unsigned char color[3];
+    std::vector<canvas_tile *> tiles; // row by row, NULL if never written
+
+    TileView(const Rect &ggrid, const unsigned char *ccolor);
+
+public:
+    virtual ~TileView();
+
+    virtual const unsigned char *row(int y, int x, int w,
+        unsigned char *scratch) const;
+};
+
+/*
+ * RGB canvas of DynamicJpegStack made of tiles that are allocated when
+ * pushed to, so memory follows the pushed area rather than the canvas size.
+ * Async encodes read a snapshot sharing the tiles; a push to a shared tile
+ * copies it first. Everything but reading rows must happen on the main
+ * thread, including deleting snapshots.
+ */
+class TiledCanvas {
+    TileView view;
+
+    canvas_tile *writable_tile(int tx, int ty);
+
+public:
+    TiledCanvas(int width, int height, const unsigned char *color);
+
+    void write(const unsigned char *data, int x, int y, int w, int h,
+        buffer_type buf_type);
+    void prepare_write(const unsigned char *data, int x, int y, int w, int h,
+        buffer_type buf_type, std::vector<blit_op> *ops);
+    bool shared(int x, int y, int w, int h) const;
+    const RowProvider *rows() const;
+    TileView *snapshot(const Rect &r) const;
+};
+
+#endif